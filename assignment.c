@@ -4,22 +4,128 @@ Name: Shreevathsa Gorur Prashanth
 Section: J
 */
 
+#define _GNU_SOURCE                     // CPU_SET and sched_setaffinity for --pin
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ftw.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
-#define NUM_PROCS 4
-#define MEM_SIZE 16
-#define CACHE_SIZE 4
-#define MAX_INSTR_NUM 32
-#define MSG_BUFFER_SIZE 256
+#define DEFAULT_NUM_PROCS 4
+#define DEFAULT_MEM_SIZE 16
+#define DEFAULT_CACHE_SIZE 4
+#define DEFAULT_MAX_INSTR_NUM 0         // no cap, traces are streamed
+#define MAX_PROCS 256
+#define SHARER_WORDS ( MAX_PROCS / 64 )
+#ifndef MSG_BUFFER_SIZE
+#define MSG_BUFFER_SIZE 256             // must be a power of two
+#endif
+#define CACHE_LINE_SIZE 64
+#define SPIN_LIMIT 1024
+#define TRACE_MAGIC "CTRC"
+#define TRACE_VERSION 1
+#define DEFAULT_BENCH_TRACE_LEN 10000000
+#define DEFAULT_HOP_LATENCY 4           // cycles per router hop on a timed network
+#define DEFAULT_LINK_BANDWIDTH 8        // bytes per cycle per link
+#define NODE_CYCLES 1                   // cycles to issue an instruction or handle a message
+#define MSG_HEADER_BYTES 8
+#define WORD_BYTES 1                    // a block, the unit instructions read and write
+#define LINK_PORTS 4                    // outgoing links per router
+#define LINK_WINDOW 256                 // cycles of reservations remembered per link
+#define MAX_FLITS ( MSG_HEADER_BYTES + SHARER_WORDS * 8 )
+#define DEFAULT_DIR_POINTERS 4
+#define MAX_DIR_POINTERS 64
+#define DIR_SPARSE_WAYS 4
+#define DIR_OVERFLOW 0x80               // header bit of a limited or coarse entry
+#define NODE_QUANTUM 64                 // events a pool worker runs on a node per turn
+#define COALESCE_WINDOW 32              // messages searched ahead for a redundant pair
+#define SNAPSHOT_MAGIC "CSNP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_QUEUE_LIMIT 256        // snapshots waiting for the writer before nodes block
+#define DEFAULT_SNAPSHOT_FILE "snapshots.bin"
+#define DEFAULT_WORKLOAD_LENGTH 10000  // instructions per node
+#define HOTSPOT_PERCENT 90              // hotspot: accesses homed on node 0
+#define PC_BUFFER_BLOCKS 8              // producer-consumer: blocks in each pair's buffer
+#define SHARED_SET_BLOCKS 4             // migratory and read-mostly: blocks everyone shares
+#define MAX_MSHRS 64
+#define CHECKPOINT_MAGIC "CCKP"
+#define CHECKPOINT_VERSION 4
+#ifndef MAX_LINE_SIZE
+#define MAX_LINE_SIZE 16                // blocks per cache line, every message has room for one line
+#endif
+#ifndef NODE_COUNTERS
+#define NODE_COUNTERS 1                 // -DNODE_COUNTERS=0 compiles every counter out
+#endif
+#if NODE_COUNTERS
+#define COUNT( node_id, counter, amount ) ( node_stats[ node_id ].counter += ( amount ) )
+#define COUNT_MAX( node_id, counter, value ) \
+    ( (value) > node_stats[ node_id ].counter ? (void) ( node_stats[ node_id ].counter = (value) ) : (void) 0 )
+#else
+#define COUNT( node_id, counter, amount ) ( (void) 0 )
+#define COUNT_MAX( node_id, counter, value ) ( (void) 0 )
+#endif
+#ifndef NODE_PADDING
+#define NODE_PADDING 1                  // -DNODE_PADDING=0 packs per-node state, for comparison
+#endif
+#if NODE_PADDING
+#define LINE_ALIGNED _Alignas( CACHE_LINE_SIZE )
+#else
+#define LINE_ALIGNED
+#endif
+#define MAX_SWEEP_ARGS 64               // options on one line of a sweep file
+#define BENCH_COUNTERS 2                // cache-misses and L1-dcache-load-misses, as perf names them
 
 typedef unsigned char byte;
 
-typedef enum { MODIFIED, EXCLUSIVE, SHARED, INVALID } cacheLineState;
+// node id in the high bits, memory index in the low bits, see machineConfig
+typedef uint32_t memAddress;
 
-typedef enum { EM, S, U } directoryEntryState;
+// dense sharer bitset wide enough for the largest machine, used in messages
+typedef struct sharerSet {
+    uint64_t words[ SHARER_WORDS ];
+} sharerSet;
+
+// OWNED only exists under MOESI: a dirty copy that serves readers while
+// others hold it SHARED, memory is stale until it is written back
+typedef enum { MODIFIED, EXCLUSIVE, SHARED, INVALID, OWNED } cacheLineState;
+
+// O: one owner with a dirty or clean copy plus sharers, MOESI only
+typedef enum { EM, S, U, O } directoryEntryState;
+
+typedef enum { PROTOCOL_MESI, PROTOCOL_MOESI } coherenceProtocol;
+
+typedef enum { WAIT_SPIN, WAIT_YIELD, WAIT_PARK } waitStrategy;
+
+typedef enum { REPLACE_LRU, REPLACE_PLRU, REPLACE_RANDOM } replacementPolicy;
+
+// full bitvector; Dir_i_B pointers that fall back to broadcast; pointers that
+// fall back to a coarse vector; full bitvectors for a cache of blocks only
+typedef enum { DIR_FULL_MAP, DIR_LIMITED, DIR_COARSE, DIR_SPARSE } directoryEncoding;
+
+typedef enum { TOPOLOGY_NONE, TOPOLOGY_CROSSBAR, TOPOLOGY_RING, TOPOLOGY_MESH } networkTopology;
+
+// next fetches the line after a miss, stride the line one stride on once two
+// misses in a row were the same distance apart
+typedef enum { PREFETCH_NONE, PREFETCH_NEXT, PREFETCH_STRIDE } prefetchPolicy;
+
+typedef enum { WORKLOAD_NONE, WORKLOAD_UNIFORM, WORKLOAD_HOTSPOT, WORKLOAD_PRODUCER_CONSUMER,
+               WORKLOAD_MIGRATORY, WORKLOAD_FALSE_SHARING, WORKLOAD_READ_MOSTLY } workloadPattern;
 
 typedef enum { 
     READ_REQUEST,
@@ -37,557 +143,5528 @@ typedef enum {
     EVICT_MODIFIED
 } transactionType;
 
+#define NUM_TRANSACTION_TYPES ( EVICT_MODIFIED + 1 )
+
+typedef struct machineConfig {
+    int num_procs;
+    int mem_size;               // memory blocks per node
+    int line_size;              // blocks per cache line, the unit coherence is kept for
+    int line_bits;
+    int mem_lines;              // lines per node, the entries of a dense directory
+    int cache_size;             // cache lines per node
+    int cache_ways;             // lines per set, cache_size when fully associative
+    int cache_sets;
+    replacementPolicy replacement;
+    int max_instr_num;          // instructions read per core trace, 0 for all
+    int sharer_words;           // 64-bit words per directory bitvector
+    int index_bits;             // low address bits selecting the memory block
+    memAddress invalid_address; // all ones, never a real block
+    networkTopology topology;   // TOPOLOGY_NONE leaves the network untimed
+    int hop_latency;
+    int link_bandwidth;
+    int mesh_width;             // routers per mesh row, the grid is square
+    directoryEncoding directory;
+    int dir_pointers;           // limited and coarse: node ids per entry
+    int coarse_group;           // coarse: nodes per bit once an entry overflows
+    int dir_entries;            // sparse: entries per node
+    int dir_ways;
+    int dir_sets;
+    int entry_bytes;            // sharer field per directory entry
+    coherenceProtocol protocol;
+    int mshrs;                  // outstanding misses per node, 0 for a blocking cache
+    prefetchPolicy prefetch;
+} machineConfig;
+
 typedef struct instruction {
     byte type;
-    byte address;
     byte value;
+    memAddress address;
 } instruction;
 
 typedef struct cacheLine {
-    byte address;
-    byte value;
+    memAddress address;
+    byte data[ MAX_LINE_SIZE ];
     cacheLineState state;
 } cacheLine;
 
+// the entry's sharer field lives at the same slot of the node's sharer_slab
 typedef struct directoryEntry {
-    byte bitVector;
     directoryEntryState state;
 } directoryEntry;
 
 typedef struct message {
     transactionType type;
     int sender;
-    byte address;
-    byte value;
-    byte bitVector;
+    memAddress address;         // a line, its first block
+    byte data[ MAX_LINE_SIZE ]; // the line on replies, flushes and write backs, the block written on a WRITE_REQUEST
     int secondReceiver;
     directoryEntryState dirState;
+    bool transfer;              // forwarded while ownership is still on its way to the receiver
+    long long timestamp;        // cycle it reaches the receiver on a timed network
+    sharerSet bitVector;
 } message;
 
+// bounded multi-producer single-consumer ring, every slot carries a sequence
+// number that tells producers and the consumer whose turn it is on the slot
+typedef struct messageSlot {
+    atomic_size_t sequence;
+    message msg;
+} messageSlot;
+
 typedef struct messageBuffer {
+    LINE_ALIGNED atomic_size_t tail;    // claimed by producers
+    LINE_ALIGNED size_t head;           // owned by the consumer
+    size_t high_water;                  // deepest backlog seen by the consumer
+    LINE_ALIGNED messageSlot slots[ MSG_BUFFER_SIZE ];
+} messageBuffer;
+
+// with a single slot a published message looks like a free slot to the next lap
+_Static_assert( MSG_BUFFER_SIZE >= 2 && ( MSG_BUFFER_SIZE & ( MSG_BUFFER_SIZE - 1 ) ) == 0,
+                "MSG_BUFFER_SIZE must be a power of two of at least 2" );
+// an MSHR keeps the blocks written while it is pending in a 64-bit mask
+_Static_assert( MAX_LINE_SIZE >= 1 && MAX_LINE_SIZE <= 64 && ( MAX_LINE_SIZE & ( MAX_LINE_SIZE - 1 ) ) == 0,
+                "MAX_LINE_SIZE must be a power of two of at most 64" );
+
+// the original mutex-protected ring, kept only as the benchmark baseline
+typedef struct lockedMessageBuffer {
     message queue[ MSG_BUFFER_SIZE ];
     int head;
     int tail;
     int count;
-} messageBuffer;
+    omp_lock_t lock;
+} lockedMessageBuffer;
 
-typedef struct processorNode {
-    cacheLine cache[ CACHE_SIZE ];
-    byte memory[ MEM_SIZE ];
-    directoryEntry directory[ MEM_SIZE ];
-    instruction instructions[ MAX_INSTR_NUM ];
-    int instructionCount;
-} processorNode;
+// binary core trace: one header followed by fixed-width records, all in host
+// byte order so the simulator can use the mapped file directly
+typedef struct traceHeader {
+    char magic[ 4 ];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t core_id;
+    uint32_t num_procs;
+    uint32_t mem_size;
+    uint32_t cache_size;
+    uint64_t record_count;
+} traceHeader;
 
-void initializeProcessor( int thread_id, processorNode *node, char *dir_name );
-void sendMessage( int receiver, message msg );
-void handleCacheReplacement( int sender, cacheLine old_cache_line );
-void printProcessorState( int processor_id, processorNode node );
+typedef struct traceRecord {
+    uint8_t op;                 // 'R' or 'W'
+    uint8_t value;
+    uint16_t think_time;        // cycles before issue, 0 when unknown
+    uint32_t address;
+} traceRecord;
 
-messageBuffer message_buffers[ NUM_PROCS ];
-omp_lock_t msg_buffer_locks[ NUM_PROCS ];
+_Static_assert( sizeof( traceHeader ) == 32, "traceHeader layout changed" );
+_Static_assert( sizeof( traceRecord ) == 8, "traceRecord layout changed" );
 
-int main( int argc, char * argv[] ) {
-    if (argc < 2) {
-        fprintf( stderr, "Usage: %s <test_directory>\n", argv[0] );
-        return EXIT_FAILURE;
-    }
-    char *input_dir = argv[1];
-    
-    omp_set_num_threads(NUM_PROCS);
+// a core trace mapped read-only and decoded one instruction at a time, so
+// memory use does not depend on the trace length
+typedef struct traceReader {
+    const char *data;
+    size_t size;
+    size_t offset;              // start of the next undecoded line
+    long long decoded;          // instructions handed out so far
+    const traceRecord *records; // NULL for text traces
+    long long record_count;
+    char filename[ 128 ];
+    int core_id;                // synthetic workloads: the generating node
+    unsigned int random_state;
+    bool has_pending;           // migratory: the write half of a read-modify-write
+    memAddress pending;
+} traceReader;
 
-    for ( int idx = 0; idx < NUM_PROCS; idx++ ) {
-        message_buffers[ idx ].count = 0;
-        message_buffers[ idx ].head = 0;
-        message_buffers[ idx ].tail = 0;
-        omp_init_lock( &msg_buffer_locks[ idx ] );
-    }
-    processorNode local_node;
+// synthetic stream every node generates instead of reading a trace
+typedef struct workloadConfig {
+    workloadPattern pattern;
+    unsigned int seed;
+    double write_ratio;         // chance an access is a write, negative for the pattern's default
+    long long length;           // instructions per node
+} workloadConfig;
 
-    #pragma omp parallel private(local_node)
-    {
-        int current_thread = omp_get_thread_num();
-        initializeProcessor( current_thread, &local_node, input_dir );
-        #pragma omp barrier
+// miss status holding register: one outstanding request for a line, plus
+// whatever later accesses to the line were merged into it
+typedef struct missEntry {
+    memAddress address;         // config.invalid_address when free
+    transactionType request;
+    byte values[ MAX_LINE_SIZE ];   // latest value written to each block while pending
+    uint64_t written;           // blocks of the line those values are for
+    bool write;                 // the line must end up MODIFIED
+    bool invalidated;           // an INV overtook the data of a read
+    bool prefetch;              // sent by the prefetcher, no access has used it yet
+    long long request_cycle;
+} missEntry;
 
-        message incoming_msg;
-        message response_msg;
-        instruction current_instr;
-        int instr_counter = -1;
-        int should_print = 1;
-        byte awaiting_response = 0;
+// caches are kept as parallel arrays, line i is way i % ways of set i / ways,
+// so a set's tags sit next to each other for the way search. The values are
+// block-major, see cacheBlock, so block 0 of line i is always cache_values[ i ]
+// whatever the line size. Like the other
+// per-node records it starts on its own cache line, so a node writing its own
+// state never invalidates a line its neighbour is using
+typedef struct processorNode {
+    LINE_ALIGNED memAddress *cache_tags;
+    byte *cache_values;
+    cacheLineState *cache_states;
+    uint32_t *cache_stamps;     // LRU: last use, PLRU: tree bits in the set's first line
+    byte *cache_prefetched;     // with a prefetcher: filled by a prefetch no access has used yet
+    uint32_t access_clock;
+    uint32_t random_state;
+    byte *memory;
+    directoryEntry *directory;  // one per block, or dir_entries when sparse
+    byte *sharer_slab;          // config.entry_bytes per directory entry
+    int *dir_tags;              // sparse: block held by each entry, -1 when free
+    uint32_t *dir_stamps;       // sparse: LRU
+    int *dir_owners;            // moesi: the owner of each entry in state O
+    int *dir_transfers;         // mshrs: node a forwarded write hands the block to, -1 once home has its FLUSH_INVACK
+    uint32_t dir_clock;
+    traceReader trace;
+    instruction current_instr;  // last issued, REPLY_WR/REPLY_ID/FLUSH_INVACK write its value
+    byte awaiting_response;
+    bool done;                  // trace exhausted
+    long long clock;            // local cycle count on a timed network
+    long long request_cycle;    // when the outstanding miss was issued
+    transactionType request_type;
+    long long events;           // messages handled and instructions issued
+    missEntry *mshrs;           // config.mshrs entries
+    int outstanding;
+    instruction next_instr;     // fetched ahead to see whether it needs an MSHR
+    bool has_next;
+    memAddress last_miss;       // stride prefetcher: line of the last demand miss
+    int miss_stride;            // and its distance from the one before
+    message *held;              // forwarded requests for blocks still pending
+    int held_count;
+    int held_capacity;
+} processorNode;
 
-        while ( true ) {
-            while ( 
-                message_buffers[ current_thread ].count > 0 &&
-                message_buffers[ current_thread ].head != message_buffers[ current_thread ].tail
-            ) {
-                if ( should_print == 0 ) {
-                    should_print++;
-                }
-                int queue_head = message_buffers[ current_thread ].head;
-                incoming_msg = message_buffers[ current_thread ].queue[ queue_head ];
-                message_buffers[ current_thread ].head = ( queue_head + 1 ) % MSG_BUFFER_SIZE;
-                message_buffers[ current_thread ].count--;
-
-                byte target_node = (incoming_msg.address >> 4) & 0x0F;
-                byte mem_location = incoming_msg.address & 0x0F;
-                byte cache_slot = mem_location % CACHE_SIZE;
-
-                switch ( incoming_msg.type ) {
-                    case WRITE_REQUEST:
-                        if (local_node.directory[mem_location].state == U) {
-                            response_msg = (message) {
-                                .type = REPLY_WR,
-                                .sender = current_thread,
-                                .address = incoming_msg.address,
-                            };
-
-                            sendMessage( incoming_msg.sender, response_msg );
-                        } else if (local_node.directory[mem_location].state == S) {
-                            byte other_nodes = local_node.directory[mem_location].bitVector & (~(1 << incoming_msg.sender));
-                            response_msg = (message) {
-                                .type = REPLY_ID,
-                                .sender = current_thread,
-                                .address = incoming_msg.address,
-                                .bitVector = other_nodes,
-                            };
-                            sendMessage( incoming_msg.sender, response_msg );
-                        } else if (local_node.directory[mem_location].state == EM) {
-                            response_msg = (message) {
-                                .type = WRITEBACK_INV,
-                                .sender = current_thread,
-                                .address = incoming_msg.address,
-                                .value = incoming_msg.value,
-                                .secondReceiver = incoming_msg.sender,
-                            };
-
-                            int previous_owner = __builtin_ctz(local_node.directory[mem_location].bitVector);
-                            sendMessage( previous_owner, response_msg );
-                        }
+typedef struct nodeWaiter {
+    LINE_ALIGNED pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    int parked;
+} nodeWaiter;
 
-                        local_node.directory[mem_location].state = EM;
-                        local_node.directory[mem_location].bitVector = (1 << incoming_msg.sender);
-
-                        break;
-
-                    case READ_REQUEST:
-                        if (local_node.directory[mem_location].state == EM) {
-                            response_msg = (message) {
-                                .type = WRITEBACK_INT,
-                                .sender = current_thread,
-                                .address = incoming_msg.address,
-                                .secondReceiver = incoming_msg.sender,
-                            };
-
-                            int previous_owner = __builtin_ctz(local_node.directory[mem_location].bitVector);
-                            sendMessage( previous_owner, response_msg );
-                        } else if (local_node.directory[mem_location].state == S) {
-                            response_msg = (message) {
-                                .type = REPLY_RD,
-                                .sender = current_thread,
-                                .address = incoming_msg.address,
-                                .value = local_node.memory[ mem_location ],
-                                .dirState = S
-                            };
-                            sendMessage( incoming_msg.sender, response_msg );
-                            local_node.directory[ mem_location ].bitVector |= (1 << incoming_msg.sender);
-                        } else if (local_node.directory[mem_location].state == U) {
-                            response_msg = (message) {
-                                .type = REPLY_RD,
-                                .sender = current_thread,
-                                .address = incoming_msg.address,
-                                .value = local_node.memory[ mem_location ],
-                                .dirState = EM
-                            };
-                            sendMessage( incoming_msg.sender, response_msg );
-                            local_node.directory[ mem_location ].state = EM;
-                            local_node.directory[ mem_location ].bitVector = (1 << incoming_msg.sender);
-                        }
-                        break;
+// messages a node could not hand over because the receiver's ring was full,
+// kept in send order and retried while the node keeps draining its own inbox
+typedef struct pendingSend {
+    int receiver;
+    message msg;
+} pendingSend;
 
-                    case REPLY_RD:
-                        if (local_node.cache[cache_slot].address != incoming_msg.address &&
-                            local_node.cache[cache_slot].state != INVALID) {
-                            handleCacheReplacement( current_thread, local_node.cache[ cache_slot ] );
-                        }
-                        local_node.cache[ cache_slot ].address = incoming_msg.address;
-                        local_node.cache[ cache_slot ].value = incoming_msg.value;
-                        local_node.cache[ cache_slot ].state = (incoming_msg.dirState == S) ? SHARED : EXCLUSIVE;
-                        awaiting_response = 0;
-                        break;
+typedef struct outbox {
+    LINE_ALIGNED pendingSend *sends;
+    int count;
+    int capacity;
+    int *deferred;              // per receiver, later sends must queue behind these
+    bool *blocked;              // scratch for flushOutbox
+} outbox;
 
-                    case WRITEBACK_INT:
-                        response_msg = (message) {
-                            .type = FLUSH,
-                            .sender = current_thread,
-                            .address = incoming_msg.address,
-                            .value = local_node.cache[ cache_slot ].value,
-                            .secondReceiver = incoming_msg.secondReceiver,
-                        };
-                        sendMessage( target_node, response_msg );
+// Chase-Lev deque of ready node ids: the owning worker pushes and pops at the
+// bottom, idle workers steal from the top. A node is queued at most once
+// machine-wide, so num_procs slots never overflow
+typedef struct workDeque {
+    LINE_ALIGNED atomic_llong top;
+    LINE_ALIGNED atomic_llong bottom;
+    atomic_int *items;
+} workDeque;
 
-                        if (target_node != incoming_msg.secondReceiver)
-                            sendMessage( incoming_msg.secondReceiver, response_msg );
+typedef struct nodeStats {
+    LINE_ALIGNED long long wait_ns;     // time spent with nothing to do
+    long long total_ns;     // time from the start barrier to termination
+    long long park_count;   // number of times the node actually slept
+    long long deferred_sends;
+    int outbox_high_water;
+    long long cache_hits;
+    long long cache_misses;
+    long long cache_evictions;
+    long long reads;
+    long long writes;
+    long long upgrades;
+    long long invalidations_sent;   // INVs fanned out on REPLY_ID
+    long long useless_invalidations;    // INVs that found no copy to invalidate
+    long long directory_evictions;  // sparse entries evicted to make room
+    long long recall_invalidations; // INVs sent for those evictions
+    long long drain_batches;        // non-empty batches taken off the ring
+    long long drained_messages;
+    long long coalesced_invalidations;  // INVs dropped for a later INV to the same block
+    long long coalesced_evictions;  // EVICT_SHARED dropped for the sender's own re-read
+    long long memory_writebacks;    // dirty data written to memory at the home
+    long long merged_misses;        // accesses merged into an outstanding miss
+    long long mshr_stalls;          // issues held back with every MSHR busy
+    long long prefetches;           // lines requested by the prefetcher
+    long long useful_prefetches;    // of those, lines an access went on to use
+    long long held_messages;        // forwarded requests that waited for a fill
+    long long response_ns;          // time spent with a miss outstanding
+    long long request_start_ns;
+    long long msgs_sent[ NUM_TRANSACTION_TYPES ];
+    long long msgs_received[ NUM_TRANSACTION_TYPES ];
+} nodeStats;
 
-                        local_node.cache[ cache_slot ].state = SHARED;
-                        break;
+// one completed miss on a timed network, keyed by the request that started it
+// and the message that finished it ( READ_REQUEST -> FLUSH is a three-hop read )
+typedef struct latencySample {
+    byte request;
+    byte reply;
+    uint32_t cycles;
+} latencySample;
 
-                    case FLUSH:
-                        if (current_thread == target_node) {
-                            local_node.directory[mem_location].state = S;
-                            local_node.directory[mem_location].bitVector |= (1 << incoming_msg.secondReceiver);
-                            local_node.memory[mem_location] = incoming_msg.value;
-                        }
+typedef struct latencyLog {
+    LINE_ALIGNED latencySample *samples;
+    int count;
+    int capacity;
+} latencyLog;
 
-                        if (current_thread == incoming_msg.secondReceiver) {
-                            if (local_node.cache[ cache_slot ].address != incoming_msg.address &&
-                                local_node.cache[ cache_slot ].state != INVALID) {
-                                handleCacheReplacement( current_thread, local_node.cache[ cache_slot ] );
-                            }
-                            local_node.cache[ cache_slot ].address = incoming_msg.address;
-                            local_node.cache[ cache_slot ].value = incoming_msg.value;
-                            local_node.cache[ cache_slot ].state = SHARED;
-                        }
+// copy of everything printProcessorState shows, taken by the node itself and
+// handed to the writer thread. state's arrays live in the same allocation
+typedef struct nodeSnapshot {
+    int node_id;
+    long long event;
+    bool final;                 // also written out as core_N_output.txt
+    processorNode state;
+    struct nodeSnapshot *next;
+} nodeSnapshot;
 
-                        awaiting_response = 0;
-                        break;
+// the last image of every node written to the snapshot file, records only
+// carry what changed since
+typedef struct snapshotImage {
+    bool written;
+    byte *memory;
+    byte *dir_states;
+    uint64_t *dir_sharers;      // sharer_words per block
+    memAddress *cache_tags;
+    byte *cache_values;         // line_size per line, in block order
+    byte *cache_states;
+} snapshotImage;
 
-                    case UPGRADE:
-                        byte other_nodes = local_node.directory[mem_location].bitVector & (~(1 << incoming_msg.sender));
+typedef struct snapshotWriter {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;       // the writer waits for snapshots
+    pthread_cond_t room;        // nodes wait while the queue is full
+    nodeSnapshot *head;
+    nodeSnapshot *tail;
+    int queued;
+    bool stopping;
+    FILE *file;                 // periodic snapshots, NULL when off
+    snapshotImage *images;
+    long long records;
+    long long bytes;
+} snapshotWriter;
 
-                        response_msg = (message) {
-                            .type = REPLY_ID,
-                            .sender = current_thread,
-                            .address = incoming_msg.address,
-                            .bitVector = other_nodes,
-                        };
-                        sendMessage( incoming_msg.sender, response_msg );
-
-                        local_node.directory[mem_location].state = EM;
-                        local_node.directory[mem_location].bitVector = (1 << incoming_msg.sender);
-
-                        break;
-
-                    case REPLY_ID:
-                        for (int i = 0; i < NUM_PROCS; i++) {
-                            if (incoming_msg.bitVector & (1 << i)) {
-                                response_msg = (message) {
-                                    .type = INV,
-                                    .sender = current_thread,
-                                    .address = incoming_msg.address,
-                                };
-                                sendMessage( i, response_msg );
-                            }
-                        }
+// periodic snapshot file: this header, then one record per snapshot. A record
+// is a snapshotRecord followed by the changed memory blocks ( u32 indices,
+// u8 values ), directory entries ( u32 indices, u8 states, sharer_words u64
+// bitvectors each ) and cache lines ( u32 indices, u32 tags, line_size u8
+// values each, u8 states ), all in host byte order
+typedef struct snapshotHeader {
+    char magic[ 4 ];
+    uint16_t version;
+    uint16_t sharer_words;
+    uint32_t num_procs;
+    uint32_t mem_size;
+    uint32_t cache_size;
+    uint32_t line_size;
+} snapshotHeader;
 
-                        if (local_node.cache[ cache_slot ].address != incoming_msg.address &&
-                            local_node.cache[ cache_slot ].state != INVALID) {
-                            handleCacheReplacement( current_thread, local_node.cache[ cache_slot ] );
-                        }
+typedef struct snapshotRecord {
+    uint32_t node_id;
+    uint32_t final;
+    uint64_t event;
+    uint32_t memory_changes;
+    uint32_t directory_changes;
+    uint32_t cache_changes;
+    uint32_t reserved;
+} snapshotRecord;
 
-                        local_node.cache[ cache_slot ].address = incoming_msg.address;
-                        local_node.cache[ cache_slot ].value = current_instr.value;
-                        local_node.cache[ cache_slot ].state = MODIFIED;
+// checkpoint file: this header, then per node a checkpointNode, its memory,
+// per memory line the directory entry ( present, state, owner under MOESI,
+// transfer with MSHRs, slot and stamp when sparse, sharer_words bitvector
+// words ), per cache line the cache ( tags, values block-major, states,
+// stamps ), its MSHRs and held requests,
+// the messages in its ring and its outbox, all in host byte order
+typedef struct checkpointHeader {
+    char magic[ 4 ];
+    uint16_t version;
+    uint16_t binary_traces;
+    uint32_t num_procs;
+    uint32_t mem_size;
+    uint32_t cache_size;
+    uint32_t cache_ways;
+    uint32_t replacement;
+    uint32_t directory;
+    uint32_t dir_entries;
+    uint32_t sharer_words;
+    uint32_t seeded;
+    uint32_t seed;
+    uint32_t random_state;      // the deterministic engine's generator
+    uint32_t protocol;
+    uint32_t mshrs;
+    uint32_t line_size;
+    uint64_t issued;            // instructions issued machine-wide
+    char input_dir[ 64 ];
+} checkpointHeader;
 
-                        awaiting_response = 0;
-                        break;
+typedef struct checkpointNode {
+    uint64_t trace_offset;
+    int64_t trace_decoded;
+    instruction current_instr;
+    uint8_t awaiting_response;
+    uint8_t done;
+    uint8_t has_next;
+    uint8_t reserved;
+    uint32_t request_type;
+    uint32_t access_clock;
+    uint32_t random_state;
+    uint32_t dir_clock;
+    int64_t clock;
+    int64_t request_cycle;
+    int64_t events;
+    uint32_t ring_count;
+    uint32_t outbox_count;
+    instruction next_instr;
+    uint32_t mshr_count;
+    uint32_t held_count;
+    uint32_t last_miss;
+    int32_t miss_stride;
+} checkpointNode;
 
-                    case INV:
-                        if (local_node.cache[ cache_slot ].address == incoming_msg.address) {
-                            local_node.cache[ cache_slot ].state = INVALID;
-                        }
-                        break;
+typedef struct latencySummary {
+    transactionType request;
+    transactionType reply;
+    int count;
+    double average;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t max;
+} latencySummary;
 
-                    case REPLY_WR:
-                        handleCacheReplacement( current_thread, local_node.cache[ cache_slot ] );
+// a text trace a sweep decoded before forking its runs, which all share it
+typedef struct preloadedTrace {
+    char filename[ 128 ];
+    traceRecord *records;
+    long long record_count;
+} preloadedTrace;
 
-                        local_node.cache[ cache_slot ].address = incoming_msg.address;
-                        local_node.cache[ cache_slot ].value = current_instr.value;
-                        local_node.cache[ cache_slot ].state = MODIFIED;
+// what one run of a sweep sends back to the parent, summed over every node
+typedef struct sweepResult {
+    char input[ 64 ];           // test directory or generated workload
+    long long wall_ns;
+    long long instructions;
+    long long hits;
+    long long misses;
+    long long upgrades;
+    long long invalidations;
+    long long writebacks;
+    long long messages;
+    long long cycles;           // last node done on a timed network, 0 otherwise
+} sweepResult;
 
-                        awaiting_response = 0;
-                        break;
+void initializeProcessor( int thread_id, processorNode *node, char *dir_name );
+void freeProcessor( processorNode *node );
+void openTrace( traceReader *trace, const char *filename, bool binary );
+bool readTraceHeader( const char *filename, traceHeader *header );
+void convertTraces( const char *dir_name );
+void benchmarkTraceLoading( long long length );
+int runSimulation( int argc, char *argv[] );
+int runSweep( const char *sweep_file, int jobs, const char *report_file, int argc, char *argv[] );
+int readSweepFile( const char *sweep_file, char ***lines );
+pid_t startSweepRun( char **base, int base_count, char *line, char *dir, char *scratch, int *result_fd );
+void preloadTraces( const char *dir_name );
+void sendSweepResult( const char *input_dir );
+void writeSweepReport( const char *filename, char **lines, int line_count,
+                       sweepResult *results, int *statuses, int runs );
+void writeQuoted( FILE *out, const char *text, bool csv );
+int removeScratchFile( const char *path, const struct stat *info, int flag, struct FTW *walk );
+void finalizeConfig();
+void printUsage( const char *program );
+bool nextInstruction( traceReader *trace, instruction *instr );
+bool nextTextRecord( traceReader *trace, traceRecord *record );
+void openWorkload( traceReader *trace, int core_id );
+bool nextSynthetic( traceReader *trace, instruction *instr );
+memAddress blockAddress( int home, int index );
+void closeTrace( traceReader *trace );
+int parsePositive( const char *arg, const char *name, int max_value );
+void *allocOrDie( size_t count, size_t size );
+void *allocLinesOrDie( size_t count, size_t size );
+int parseCpuList( const char *text, int *cpus, int max_count );
+void buildPinList( const char *policy );
+void pinThread( int index );
+int homeNode( memAddress address );
+int memIndex( memAddress address );
+memAddress lineAddress( memAddress address );
+int lineOffset( memAddress address );
+void sharersClear( uint64_t *bits );
+void sharersAdd( uint64_t *bits, int node_id );
+void sharersRemove( uint64_t *bits, int node_id );
+int sharersCount( const uint64_t *bits );
+int sharersFirst( const uint64_t *bits );
+sharerSet sharersExcept( const uint64_t *bits, int node_id );
+int directorySlot( int node_id, int mem_location, bool allocate );
+int directoryFind( processorNode *node, int mem_location );
+void directoryClear( processorNode *node, int slot );
+void directoryAdd( processorNode *node, int slot, int node_id );
+void directoryRemove( processorNode *node, int slot, int node_id );
+int directoryCount( processorNode *node, int slot );
+int directoryFirst( processorNode *node, int slot );
+sharerSet directorySharers( processorNode *node, int slot );
+sharerSet directoryExcept( processorNode *node, int slot, int node_id );
+size_t directoryBytes( directoryEncoding encoding );
+void printDirectorySummary();
+int cacheFind( processorNode *node, memAddress address );
+int cacheLocate( processorNode *node, memAddress address );
+int cacheSlotFor( processorNode *node, memAddress address );
+void cacheFill( processorNode *node, int slot, memAddress address, const byte *data, cacheLineState state );
+byte *cacheBlock( processorNode *node, int slot, int block );
+void cacheReadLine( processorNode *node, int slot, byte *data );
+void cacheTouch( processorNode *node, int slot );
+cacheLine cacheLineAt( processorNode *node, int slot );
+void formatSharers( const uint64_t *bits, char *out );
+void sendMessage( int receiver, message msg );
+void handleCacheReplacement( int sender, cacheLine old_cache_line );
+void printProcessorState( int processor_id, processorNode *node );
+void countEvent( int node_id );
+void takeSnapshot( int node_id, bool final );
+void startSnapshotWriter( const char *filename );
+void stopSnapshotWriter();
+void *runSnapshotWriter( void *arg );
+void writeSnapshotRecord( nodeSnapshot *snapshot );
+void writeCheckpoint( const char *filename, const char *input_dir, long long issued,
+                      bool seeded, unsigned int seed, unsigned int random_state );
+void restoreCheckpoint( const char *filename, const char *input_dir );
+void initMessageBuffer( messageBuffer *msg_buf );
+bool enqueueMessage( messageBuffer *msg_buf, message msg );
+bool dequeueMessage( messageBuffer *msg_buf, message *msg );
+int dequeueBatch( messageBuffer *msg_buf, message *batch, int max_count );
+bool lockedEnqueueMessage( lockedMessageBuffer *msg_buf, message msg );
+bool lockedDequeueMessage( lockedMessageBuffer *msg_buf, message *msg );
+void benchmarkQueues();
+void benchmarkLayout();
+void openCacheCounters( int *fds );
+void closeCacheCounters( int *fds, long long *totals );
+void formatCount( long long count, char *out );
+void deferMessage( outbox *out, int receiver, message msg );
+void flushOutbox( int node_id );
+void retireMessages( int count );
+void retireNode();
+bool simulationFinished();
+bool hasMessages( int node_id );
+void waitForMessages( int node_id );
+void wakeNode( int node_id );
+void wakeAllNodes();
+long long nowNanos();
+void printNodeStats();
+void writeReport( const char *filename, const char *engine );
+long long networkArrival( int sender, int receiver, long long send_cycle, const message *msg );
+int routeLinks( int sender, int receiver, int *links );
+int messageBytes( const message *msg );
+void recordMissLatency( int node_id, transactionType request, long long request_cycle, transactionType reply );
+int summarizeLatencies( latencySummary **summaries );
+void printLatencySummary();
+void runThreaded( char *input_dir );
+void runDeterministic( char *input_dir, const char *order_file, unsigned int seed );
+void runPool( char *input_dir );
+bool runNode( int node_id, int worker );
+void scheduleNode( int node_id, int worker );
+bool advanceWindow();
+void dequePush( workDeque *deque, int node_id );
+bool dequePop( workDeque *deque, int *node_id );
+bool dequeSteal( workDeque *deque, int *node_id );
+void handleMessage( int current_thread, message incoming_msg );
+void removeSharer( int node_id, int dir, memAddress address, int sharer );
+void dropLostOwner( processorNode *node, int dir );
+void promoteLastSharer( processorNode *node, memAddress address );
+int mshrFind( processorNode *node, memAddress address );
+bool pendingTransfer( processorNode *node, int dir, int owner );
+bool needsMshr( processorNode *node, instruction instr );
+void allocateMiss( int node_id, transactionType request, instruction instr, bool prefetch );
+void prefetchAfterMiss( int node_id, memAddress line );
+void issueNonBlocking( int node_id, instruction instr, int cache_pos, bool cache_hit );
+void checkStall( int node_id );
+void completeMiss( int node_id, memAddress address, transactionType reply );
+void fillMiss( int node_id, memAddress address, const byte *data, cacheLineState state );
+void fillWrite( int node_id, memAddress address, const byte *data );
+void markInvalidated( processorNode *node, memAddress address );
+bool holdMessage( int node_id, message msg );
+bool issueInstruction( int current_thread );
+bool deliverOneMessage( int node_id );
+int drainMessages( int node_id, int max_count );
+bool coalesceMessage( int node_id, const message *batch, int idx, int count );
+void drainNetwork();
+unsigned int nextRandom( unsigned int *state );
 
-                    case WRITEBACK_INV:
-                        response_msg = (message) {
-                            .type = FLUSH_INVACK,
-                            .sender = current_thread,
-                            .address = incoming_msg.address,
-                            .value = local_node.cache[ cache_slot ].value,
-                            .secondReceiver = incoming_msg.secondReceiver,
-                        };
-                        sendMessage( target_node, response_msg );
-                        sendMessage( incoming_msg.secondReceiver, response_msg );
+machineConfig config = {
+    .num_procs = DEFAULT_NUM_PROCS,
+    .mem_size = DEFAULT_MEM_SIZE,
+    .line_size = 1,
+    .cache_size = DEFAULT_CACHE_SIZE,
+    .cache_ways = 1,
+    .replacement = REPLACE_LRU,
+    .max_instr_num = DEFAULT_MAX_INSTR_NUM,
+    .topology = TOPOLOGY_NONE,
+    .hop_latency = DEFAULT_HOP_LATENCY,
+    .link_bandwidth = DEFAULT_LINK_BANDWIDTH,
+    .directory = DIR_FULL_MAP,
+    .dir_pointers = DEFAULT_DIR_POINTERS,
+};
 
-                        local_node.cache[ cache_slot ].state = INVALID;
+// per-node arrays, sized from config.num_procs once the options are parsed
+messageBuffer *message_buffers;
+processorNode *nodes;
 
-                        break;
+// global quiescence detection: the simulation is over once every node has
+// exhausted its instruction stream and no message is queued or being handled.
+// Every send updates pending_messages while idle nodes poll simulation_done,
+// so each gets a line of its own
+LINE_ALIGNED int pending_messages = 0;
+LINE_ALIGNED int active_nodes = 0;
+LINE_ALIGNED int simulation_done = 0;
 
-                    case FLUSH_INVACK:
-                        if (current_thread == target_node) {
-                            local_node.directory[mem_location].bitVector = (1 << incoming_msg.secondReceiver);
-                            local_node.memory[mem_location] = incoming_msg.value;
-                        }
+waitStrategy wait_strategy = WAIT_PARK;
+bool binary_traces = false;
+nodeWaiter *node_waiters;
+nodeStats *node_stats;
+outbox *outboxes;
+latencyLog *latency_logs;
 
-                        if (current_thread == incoming_msg.secondReceiver) {
-                            if (local_node.cache[ cache_slot ].address != incoming_msg.address &&
-                                local_node.cache[ cache_slot ].state != INVALID) {
-                                handleCacheReplacement( current_thread, local_node.cache[ cache_slot ] );
-                            }
-                            local_node.cache[ cache_slot ].address = incoming_msg.address;
-                            local_node.cache[ cache_slot ].value = current_instr.value;
-                            local_node.cache[ cache_slot ].state = MODIFIED;
-                        }
+const char *transactionTypeStr[] = { "READ_REQUEST", "WRITE_REQUEST", "REPLY_RD",
+    "REPLY_WR", "REPLY_ID", "INV", "UPGRADE", "WRITEBACK_INV", "WRITEBACK_INT",
+    "FLUSH", "FLUSH_INVACK", "EVICT_SHARED", "EVICT_MODIFIED" };
 
-                        awaiting_response = 0;
-                        break;
+// worker pool engine, see runPool
+int num_workers;                // 0 runs one thread per node
+workDeque *work_deques;
+int deque_mask;
+atomic_int *node_scheduled;     // set while the node is queued or running
+LINE_ALIGNED atomic_long ready_nodes;   // nodes queued or running, 0 ends a window
+LINE_ALIGNED long long window_end = LLONG_MAX;  // nodes only issue below this cycle, read on every issue
+bool pool_finished;
+long long run_ns;
 
-                    case EVICT_SHARED:
-                        if (current_thread != target_node) {
-                            local_node.cache[ cache_slot ].state = EXCLUSIVE;
-                        } else {
-                            local_node.directory[mem_location].bitVector &= ~(1 << incoming_msg.sender);
-
-                            int sharer_count = __builtin_popcount(local_node.directory[mem_location].bitVector);
-                            if (sharer_count == 0) {
-                                local_node.directory[mem_location].state = U;
-                            } else if (sharer_count == 1) {
-                                local_node.directory[mem_location].state = EM;
-
-                                int new_owner = __builtin_ctz(local_node.directory[mem_location].bitVector);
-
-                                if (new_owner != target_node) {
-                                    incoming_msg = (message) {
-                                        .type = EVICT_SHARED,
-                                        .sender = current_thread,
-                                        .address = incoming_msg.address,
-                                        .value = local_node.memory[ mem_location ],
-                                    };
-                                    sendMessage( new_owner, incoming_msg );
-                                } else {
-                                    local_node.cache[ cache_slot ].state = EXCLUSIVE;
-                                }
-                            }
-                        }
-                        break;
+const char *directoryEncodingStr[] = { "full", "limited", "coarse", "sparse" };
 
-                    case EVICT_MODIFIED:
-                        local_node.memory[mem_location] = incoming_msg.value;
-                        local_node.directory[mem_location].bitVector = 0;
-                        local_node.directory[mem_location].state = U;
-                        break;
-                }
-            }
+const char *protocolStr[] = { "mesi", "moesi" };
 
-            if ( awaiting_response > 0 ) {
-                continue;
-            }
+const char *prefetchPolicyStr[] = { "none", "next", "stride" };
 
-            if ( instr_counter < local_node.instructionCount - 1 ) {
-                instr_counter++;
-            } else {
-                if ( should_print > 0 ) {
-                    printProcessorState( current_thread, local_node );
-                    should_print--;
-                }
-                continue;
-            }
-            current_instr = local_node.instructions[ instr_counter ];
+const char *workloadPatternStr[] = { "none", "uniform", "hotspot", "producer-consumer",
+    "migratory", "false-sharing", "read-mostly" };
+// write ratio used when --write-ratio is not given
+const double workloadWriteRatio[] = { 0.0, 0.3, 0.3, 0.9, 1.0, 0.5, 0.02 };
+workloadConfig workload = {
+    .pattern = WORKLOAD_NONE,
+    .seed = 1,
+    .write_ratio = -1.0,
+    .length = DEFAULT_WORKLOAD_LENGTH,
+};
+
+long long snapshot_interval;    // events between periodic snapshots, 0 for none
+
+// checkpoint and restore, see writeCheckpoint
+const char *checkpoint_file;
+long long checkpoint_at;        // instructions issued machine-wide before it is written
+const char *restore_file;
+long long restored_issued;
+bool restored_seeded;
+unsigned int restored_seed;
+unsigned int restored_random_state;
+snapshotWriter snapshot_writer;
+atomic_llong *link_slots;       // LINK_WINDOW reserved cycles per link, LINK_PORTS links per router
 
-            byte target_proc = (current_instr.address >> 4) & 0x0F;
-            byte mem_pos = current_instr.address & 0x0F;
-            byte cache_pos = mem_pos % CACHE_SIZE;
+// sweeps, see runSweep
+preloadedTrace *preloaded_traces;
+int preloaded_count;
+int sweep_result_fd = -1;       // set in a sweep's runs, which report through it
+
+// --pin: thread i of an engine runs on pin_cpus[ i % pin_count ], unpinned when 0
+const char *pin_policy;
+int *pin_cpus;
+int pin_count;
+
+int main( int argc, char * argv[] ) {
+    return runSimulation( argc, argv );
+}
 
-            int cache_hit = local_node.cache[cache_pos].address == current_instr.address
-                          ? local_node.cache[cache_pos].state == INVALID ? 0 : 1
-                          : 0;
+// everything main does, also entered by each run of a sweep with its own options
+int runSimulation( int argc, char *argv[] ) {
+    static struct option long_options[] = {
+        { "wait",  required_argument, NULL, 'w' },
+        { "stats", no_argument,       NULL, 's' },
+        { "bench-queue", no_argument, NULL, 'q' },
+        { "procs",      required_argument, NULL, 'p' },
+        { "mem-size",   required_argument, NULL, 'm' },
+        { "cache-size", required_argument, NULL, 'c' },
+        { "max-instr",  required_argument, NULL, 'i' },
+        { "binary",      no_argument,       NULL, 'b' },
+        { "convert",     no_argument,       NULL, 'C' },
+        { "bench-trace", optional_argument, NULL, 'T' },
+        { "assoc",       required_argument, NULL, 'a' },
+        { "replacement", required_argument, NULL, 'r' },
+        { "replay",      optional_argument, NULL, 'R' },
+        { "seed",        required_argument, NULL, 'S' },
+        { "report",      required_argument, NULL, 'o' },
+        { "topology",    required_argument, NULL, 't' },
+        { "hop-latency", required_argument, NULL, 'l' },
+        { "link-bandwidth", required_argument, NULL, 'B' },
+        { "directory",   required_argument, NULL, 'd' },
+        { "dir-pointers", required_argument, NULL, 'P' },
+        { "dir-entries", required_argument, NULL, 'E' },
+        { "workers",     optional_argument, NULL, 'W' },
+        { "snapshot-every", required_argument, NULL, 'N' },
+        { "snapshot-file", required_argument, NULL, 'F' },
+        { "checkpoint",  required_argument, NULL, 'k' },
+        { "checkpoint-at", required_argument, NULL, 'K' },
+        { "restore",     required_argument, NULL, 'x' },
+        { "workload",    required_argument, NULL, 'g' },
+        { "workload-seed", required_argument, NULL, 'e' },
+        { "write-ratio", required_argument, NULL, 'f' },
+        { "length",      required_argument, NULL, 'L' },
+        { "protocol",    required_argument, NULL, 'M' },
+        { "mshrs",       required_argument, NULL, 'H' },
+        { "line-size",   required_argument, NULL, 'y' },
+        { "prefetch",    required_argument, NULL, 'j' },
+        { "pin",         required_argument, NULL, 'A' },
+        { "sweep",       required_argument, NULL, 'Z' },
+        { "jobs",        required_argument, NULL, 'J' },
+        { NULL, 0, NULL, 0 }
+    };
+    bool print_stats = false;
+    bool bench_queue = false;
+    long long bench_trace = 0;
+    bool convert = false;
+    bool machine_given = false;
+    int assoc = 1;
+    char *replay_file = NULL;
+    bool replay = false;
+    bool seeded = false;
+    unsigned int seed = 0;
+    char *report_file = NULL;
+    char *snapshot_file = NULL;
+    char *sweep_file = NULL;
+    int jobs = omp_get_num_procs();
+    int opt;
 
-            if ( current_instr.type == 'R' ) {
-                if (cache_hit) {
-                    do { } while (false);
+    while ( ( opt = getopt_long( argc, argv, "w:sp:m:c:i:ba:r:", long_options, NULL ) ) != -1 ) {
+        switch ( opt ) {
+            case 'w':
+                if ( strcmp( optarg, "spin" ) == 0 ) {
+                    wait_strategy = WAIT_SPIN;
+                } else if ( strcmp( optarg, "yield" ) == 0 ) {
+                    wait_strategy = WAIT_YIELD;
+                } else if ( strcmp( optarg, "park" ) == 0 ) {
+                    wait_strategy = WAIT_PARK;
                 } else {
-                    incoming_msg = (message) {
-                        .type = READ_REQUEST,
-                        .sender = current_thread,
-                        .address = current_instr.address,
-                    };
-                    sendMessage( target_proc, incoming_msg );
-                    awaiting_response = 1;
+                    fprintf( stderr, "Error: unknown wait strategy %s\n", optarg );
+                    return EXIT_FAILURE;
                 }
-            } else {
-                if (cache_hit) {
-                    if (local_node.cache[cache_pos].state == MODIFIED ||
-                        local_node.cache[cache_pos].state == EXCLUSIVE) {
-                        local_node.cache[cache_pos].value = current_instr.value;
-                        local_node.cache[cache_pos].state = MODIFIED;
-                    } else {
-                        incoming_msg = (message) {
-                            .type = UPGRADE,
-                            .sender = current_thread,
-                            .address = current_instr.address,
-                            .value = current_instr.value
-                        };
-                        sendMessage( target_proc, incoming_msg );
-                        awaiting_response = 1;
-                    }
+                break;
+            case 's':
+                print_stats = true;
+                break;
+            case 'q':
+                bench_queue = true;
+                break;
+            case 'p':
+                config.num_procs = parsePositive( optarg, "procs", MAX_PROCS );
+                machine_given = true;
+                break;
+            case 'm':
+                config.mem_size = parsePositive( optarg, "mem-size", 1 << 20 );
+                machine_given = true;
+                break;
+            case 'c':
+                config.cache_size = parsePositive( optarg, "cache-size", 1 << 20 );
+                machine_given = true;
+                break;
+            case 'i':
+                config.max_instr_num = parsePositive( optarg, "max-instr", INT32_MAX );
+                break;
+            case 'b':
+                binary_traces = true;
+                break;
+            case 'C':
+                convert = true;
+                break;
+            case 'a':
+                // 0 selects a fully associative cache
+                assoc = strcmp( optarg, "0" ) == 0 ? 0 : parsePositive( optarg, "assoc", 1 << 20 );
+                break;
+            case 'R':
+                replay = true;
+                replay_file = optarg;
+                break;
+            case 'o':
+                report_file = optarg;
+                break;
+            case 'S':
+                seeded = true;
+                seed = (unsigned int) strtoul( optarg, NULL, 10 );
+                break;
+            case 'r':
+                if ( strcmp( optarg, "lru" ) == 0 ) {
+                    config.replacement = REPLACE_LRU;
+                } else if ( strcmp( optarg, "plru" ) == 0 ) {
+                    config.replacement = REPLACE_PLRU;
+                } else if ( strcmp( optarg, "random" ) == 0 ) {
+                    config.replacement = REPLACE_RANDOM;
                 } else {
-                    incoming_msg = (message) {
-                        .type = WRITE_REQUEST,
-                        .sender = current_thread,
-                        .address = current_instr.address,
-                        .value = current_instr.value
-                    };
-                    sendMessage( target_proc, incoming_msg );
-                    awaiting_response = 1;
+                    fprintf( stderr, "Error: unknown replacement policy %s\n", optarg );
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                if ( strcmp( optarg, "none" ) == 0 ) {
+                    config.topology = TOPOLOGY_NONE;
+                } else if ( strcmp( optarg, "crossbar" ) == 0 ) {
+                    config.topology = TOPOLOGY_CROSSBAR;
+                } else if ( strcmp( optarg, "ring" ) == 0 ) {
+                    config.topology = TOPOLOGY_RING;
+                } else if ( strcmp( optarg, "mesh" ) == 0 ) {
+                    config.topology = TOPOLOGY_MESH;
+                } else {
+                    fprintf( stderr, "Error: unknown topology %s\n", optarg );
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                if ( strcmp( optarg, "full" ) == 0 ) {
+                    config.directory = DIR_FULL_MAP;
+                } else if ( strcmp( optarg, "limited" ) == 0 ) {
+                    config.directory = DIR_LIMITED;
+                } else if ( strcmp( optarg, "coarse" ) == 0 ) {
+                    config.directory = DIR_COARSE;
+                } else if ( strcmp( optarg, "sparse" ) == 0 ) {
+                    config.directory = DIR_SPARSE;
+                } else {
+                    fprintf( stderr, "Error: unknown directory encoding %s\n", optarg );
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'M':
+                if ( strcmp( optarg, "mesi" ) == 0 ) {
+                    config.protocol = PROTOCOL_MESI;
+                } else if ( strcmp( optarg, "moesi" ) == 0 ) {
+                    config.protocol = PROTOCOL_MOESI;
+                } else {
+                    fprintf( stderr, "Error: unknown protocol %s\n", optarg );
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                config.mshrs = parsePositive( optarg, "mshrs", MAX_MSHRS );
+                break;
+            case 'y':
+                config.line_size = parsePositive( optarg, "line-size", MAX_LINE_SIZE );
+                machine_given = true;
+                break;
+            case 'j':
+                if ( strcmp( optarg, "none" ) == 0 ) {
+                    config.prefetch = PREFETCH_NONE;
+                } else if ( strcmp( optarg, "next" ) == 0 ) {
+                    config.prefetch = PREFETCH_NEXT;
+                } else if ( strcmp( optarg, "stride" ) == 0 ) {
+                    config.prefetch = PREFETCH_STRIDE;
+                } else {
+                    fprintf( stderr, "Error: unknown prefetcher %s\n", optarg );
+                    return EXIT_FAILURE;
                 }
+                break;
+            case 'A':
+                pin_policy = optarg;
+                break;
+            case 'Z':
+                sweep_file = optarg;
+                break;
+            case 'J':
+                jobs = parsePositive( optarg, "jobs", 1024 );
+                break;
+            case 'W':
+                num_workers = optarg ? parsePositive( optarg, "workers", MAX_PROCS ) : omp_get_num_procs();
+                break;
+            case 'N':
+                snapshot_interval = parsePositive( optarg, "snapshot-every", INT32_MAX );
+                break;
+            case 'F':
+                snapshot_file = optarg;
+                break;
+            case 'k':
+                checkpoint_file = optarg;
+                break;
+            case 'K':
+                checkpoint_at = parsePositive( optarg, "checkpoint-at", INT32_MAX );
+                break;
+            case 'x':
+                restore_file = optarg;
+                break;
+            case 'g':
+                workload.pattern = WORKLOAD_NONE;
+                for ( int pattern = WORKLOAD_UNIFORM; pattern <= WORKLOAD_READ_MOSTLY; pattern++ ) {
+                    if ( strcmp( optarg, workloadPatternStr[ pattern ] ) == 0 ) {
+                        workload.pattern = pattern;
+                    }
+                }
+                if ( workload.pattern == WORKLOAD_NONE ) {
+                    fprintf( stderr, "Error: unknown workload %s\n", optarg );
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'e':
+                workload.seed = (unsigned int) strtoul( optarg, NULL, 10 );
+                break;
+            case 'f': {
+                char *end;
+                workload.write_ratio = strtod( optarg, &end );
+                if ( *end != '\0' || end == optarg || workload.write_ratio < 0.0 || workload.write_ratio > 1.0 ) {
+                    fprintf( stderr, "Error: --write-ratio must be between 0 and 1\n" );
+                    return EXIT_FAILURE;
+                }
+                break;
             }
+            case 'L':
+                workload.length = parsePositive( optarg, "length", INT32_MAX );
+                break;
+            case 'P':
+                config.dir_pointers = parsePositive( optarg, "dir-pointers", MAX_DIR_POINTERS );
+                break;
+            case 'E':
+                config.dir_entries = parsePositive( optarg, "dir-entries", 1 << 24 );
+                break;
+            case 'l':
+                config.hop_latency = parsePositive( optarg, "hop-latency", 1 << 20 );
+                break;
+            case 'B':
+                config.link_bandwidth = parsePositive( optarg, "link-bandwidth", 1 << 20 );
+                break;
+            case 'T':
+                bench_trace = optarg ? parsePositive( optarg, "bench-trace", INT32_MAX )
+                                     : DEFAULT_BENCH_TRACE_LEN;
+                break;
+            default:
+                printUsage( argv[0] );
+                return EXIT_FAILURE;
         }
     }
-}
+    if ( sweep_file ) {
+        return runSweep( sweep_file, jobs, report_file, argc, argv );
+    }
+    if ( pin_policy ) {
+        buildPinList( pin_policy );
+    }
+    if ( bench_queue ) {
+        benchmarkQueues();
+        benchmarkLayout();
+        return EXIT_SUCCESS;
+    }
+    // a generated workload needs no test directory, its parameters stand in
+    // for the name where one is recorded
+    char workload_name[ 64 ];
+    char *input_dir = optind < argc ? argv[optind] : NULL;
+    if ( workload.pattern != WORKLOAD_NONE ) {
+        if ( workload.write_ratio < 0.0 ) {
+            workload.write_ratio = workloadWriteRatio[ workload.pattern ];
+        }
+        if ( binary_traces || convert || input_dir ) {
+            fprintf( stderr, "Error: --workload replaces the test directory and its traces\n" );
+            return EXIT_FAILURE;
+        }
+        snprintf( workload_name, sizeof( workload_name ), "%s:%u:%.3f:%lld",
+                  workloadPatternStr[ workload.pattern ], workload.seed, workload.write_ratio,
+                  workload.length );
+        input_dir = workload_name;
+    }
+    // the trace benchmark writes its own traces, it only needs the machine
+    if ( !input_dir && !bench_trace ) {
+        printUsage( argv[0] );
+        return EXIT_FAILURE;
+    }
 
-void sendMessage( int receiver, message msg ) {
-    omp_set_lock( &msg_buffer_locks[ receiver ] );
+    // a bare --replay follows the order recorded next to the traces
+    char default_order[ 128 ];
+    if ( replay && !replay_file && input_dir ) {
+        snprintf( default_order, sizeof( default_order ), "tests/%s/instruction_order.txt", input_dir );
+        replay_file = default_order;
+    }
 
-    messageBuffer *msg_buf = &message_buffers[ receiver ];
-    if (msg_buf->count < MSG_BUFFER_SIZE) {
-      msg_buf->queue[ msg_buf->tail ] = msg;
-      msg_buf->tail = (msg_buf->tail + 1 ) % MSG_BUFFER_SIZE;
-      msg_buf->count++;
-    } 
+    // binary traces carry the machine they were converted for
+    if ( binary_traces && input_dir ) {
+        char filename[ 128 ];
+        traceHeader header;
+        snprintf( filename, sizeof( filename ), "tests/%s/core_0.trc", input_dir );
+        if ( !readTraceHeader( filename, &header ) ) {
+            return EXIT_FAILURE;
+        }
+        if ( machine_given && ( header.num_procs != (uint32_t) config.num_procs ||
+                                header.mem_size != (uint32_t) config.mem_size ||
+                                header.cache_size != (uint32_t) config.cache_size ) ) {
+            fprintf( stderr, "Error: %s was converted for a %ux%ux%u machine\n", filename,
+                     header.num_procs, header.mem_size, header.cache_size );
+            return EXIT_FAILURE;
+        }
+        config.num_procs = header.num_procs;
+        config.mem_size = header.mem_size;
+        config.cache_size = header.cache_size;
+    }
 
-    omp_unset_lock( &msg_buffer_locks[ receiver ] );
-}
+    if ( ( config.line_size & ( config.line_size - 1 ) ) != 0 || config.mem_size % config.line_size != 0 ) {
+        fprintf( stderr, "Error: --line-size must be a power of two that divides --mem-size\n" );
+        return EXIT_FAILURE;
+    }
+    // the blocking cache ends its wait on any reply, a prefetch's would end it too
+    if ( config.prefetch != PREFETCH_NONE && !config.mshrs ) {
+        fprintf( stderr, "Error: --prefetch needs --mshrs\n" );
+        return EXIT_FAILURE;
+    }
+    config.cache_ways = assoc == 0 ? config.cache_size : assoc;
+    if ( config.cache_size % config.cache_ways != 0 ) {
+        fprintf( stderr, "Error: --cache-size must be a multiple of --assoc\n" );
+        return EXIT_FAILURE;
+    }
+    if ( config.replacement == REPLACE_PLRU &&
+         ( ( config.cache_ways & ( config.cache_ways - 1 ) ) != 0 || config.cache_ways > 32 ) ) {
+        fprintf( stderr, "Error: plru needs a power of two associativity of at most 32\n" );
+        return EXIT_FAILURE;
+    }
 
-void handleCacheReplacement( int sender, cacheLine old_cache_line ) {
-    byte mem_pos = old_cache_line.address & 0x0F;
-    byte target_proc = (old_cache_line.address >> 4) & 0x0F;
-    message evict_msg;
-    
-    switch ( old_cache_line.state ) {
-        case MODIFIED:
-            evict_msg = (message) {
-                .type = EVICT_MODIFIED,
-                .sender = sender,
-                .address = old_cache_line.address,
-                .value = old_cache_line.value,
-            };
-            sendMessage( target_proc, evict_msg );
-            break;
-        case EXCLUSIVE:
-        case SHARED:
-            evict_msg = (message) {
-                .type = EVICT_SHARED,
-                .sender = sender,
-                .address = old_cache_line.address,
-            };
-            sendMessage( target_proc, evict_msg );
-            break;
-        case INVALID:
-            break;
+    finalizeConfig();
+    if ( num_workers && ( replay_file || seeded ) ) {
+        fprintf( stderr, "Error: --workers cannot be combined with --replay or --seed\n" );
+        return EXIT_FAILURE;
     }
-}
-// --- IMPORTANT: DO NOT MODIFY --
+    // a run's checkpoint would record a preloaded trace's position wrongly
+    if ( checkpoint_file && sweep_result_fd >= 0 ) {
+        fprintf( stderr, "Error: --checkpoint cannot be part of a sweep\n" );
+        return EXIT_FAILURE;
+    }
+    if ( checkpoint_file && ( !checkpoint_at || !( replay_file || seeded ) ) ) {
+        fprintf( stderr, "Error: --checkpoint needs --checkpoint-at and --replay or --seed\n" );
+        return EXIT_FAILURE;
+    }
+    if ( num_workers > config.num_procs ) {
+        num_workers = config.num_procs;
+    }
+    if ( config.directory == DIR_SPARSE && config.dir_entries % config.dir_ways != 0 ) {
+        fprintf( stderr, "Error: --dir-entries must be a multiple of %d\n", config.dir_ways );
+        return EXIT_FAILURE;
+    }
+    if ( bench_trace ) {
+        benchmarkTraceLoading( bench_trace );
+        return EXIT_SUCCESS;
+    }
+    if ( convert ) {
+        convertTraces( input_dir );
+        return EXIT_SUCCESS;
+    }
+    active_nodes = config.num_procs;
 
-void initializeProcessor( int threadId, processorNode *node, char *dirName ) {
-    // IMPORTANT: DO NOT MODIFY
-    for ( int i = 0; i < MEM_SIZE; i++ ) {
-        node->memory[ i ] = 20 * threadId + i;  // some initial value to mem block
-        node->directory[ i ].bitVector = 0;     // no cache has this block at start
-        node->directory[ i ].state = U;         // this block is in Unowned state
+    // the rings are left untouched here: each is initialized by the thread
+    // that drains it, so the kernel places its pages on that thread's NUMA node
+    size_t ring_bytes = config.num_procs * sizeof( messageBuffer );
+    message_buffers = mmap( NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    nodes = allocLinesOrDie( config.num_procs, sizeof( processorNode ) );
+    node_waiters = allocLinesOrDie( config.num_procs, sizeof( nodeWaiter ) );
+    node_stats = allocLinesOrDie( config.num_procs, sizeof( nodeStats ) );
+    outboxes = allocLinesOrDie( config.num_procs, sizeof( outbox ) );
+    latency_logs = allocLinesOrDie( config.num_procs, sizeof( latencyLog ) );
+    int routers = config.num_procs > config.mesh_width * config.mesh_width ?
+                  config.num_procs : config.mesh_width * config.mesh_width;
+    link_slots = allocOrDie( (size_t) routers * LINK_PORTS * LINK_WINDOW, sizeof( atomic_llong ) );
+    for ( size_t slot = 0; slot < (size_t) routers * LINK_PORTS * LINK_WINDOW; slot++ ) {
+        atomic_init( &link_slots[ slot ], -1 );
+    }
+    if ( message_buffers == MAP_FAILED ) {
+        fprintf( stderr, "Error: could not allocate message buffers\n" );
+        return EXIT_FAILURE;
     }
 
-    for ( int i = 0; i < CACHE_SIZE; i++ ) {
-        node->cache[ i ].address = 0xFF;        // this address is invalid as we can
-                                                // have a maximum of 8 nodes in the 
-                                                // current implementation
-        node->cache[ i ].value = 0;
-        node->cache[ i ].state = INVALID;       // all cache lines are invalid
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        pthread_mutex_init( &node_waiters[ idx ].mutex, NULL );
+        pthread_cond_init( &node_waiters[ idx ].wakeup, NULL );
+        node_waiters[ idx ].parked = 0;
+        outboxes[ idx ].deferred = allocOrDie( config.num_procs, sizeof( int ) );
+        outboxes[ idx ].blocked = allocOrDie( config.num_procs, sizeof( bool ) );
     }
 
-    // read and parse instructions from core_<threadId>.txt
-    char filename[ 128 ];
-    snprintf(filename, sizeof(filename), "tests/%s/core_%d.txt", dirName, threadId);
-    FILE *file = fopen( filename, "r" );
-    if ( !file ) {
-        fprintf( stderr, "Error: count not open file %s\n", filename );
-        exit( EXIT_FAILURE );
+    if ( snapshot_interval && !snapshot_file ) {
+        snapshot_file = DEFAULT_SNAPSHOT_FILE;
     }
+    startSnapshotWriter( snapshot_file );
 
-    char line[ 20 ];
-    node->instructionCount = 0;
-    while ( fgets( line, sizeof( line ), file ) &&
-            node->instructionCount < MAX_INSTR_NUM ) {
-        if ( line[ 0 ] == 'R' && line[ 1 ] == 'D' ) {
-            sscanf( line, "RD %hhx",
-                    &node->instructions[ node->instructionCount ].address );
-            node->instructions[ node->instructionCount ].type = 'R';
-            node->instructions[ node->instructionCount ].value = 0;
-        } else if ( line[ 0 ] == 'W' && line[ 1 ] == 'R' ) {
-            sscanf( line, "WR %hhx %hhu",
-                    &node->instructions[ node->instructionCount ].address,
-                    &node->instructions[ node->instructionCount ].value );
-            node->instructions[ node->instructionCount ].type = 'W';
-        }
-        node->instructionCount++;
+    long long run_start = nowNanos();
+    if ( replay_file || seeded ) {
+        runDeterministic( input_dir, replay_file, seed );
+    } else if ( num_workers ) {
+        runPool( input_dir );
+    } else {
+        runThreaded( input_dir );
     }
+    run_ns = nowNanos() - run_start;
+    stopSnapshotWriter();
 
-    fclose( file );
-    printf( "Processor %d initialized\n", threadId );
+    if ( print_stats ) {
+        printNodeStats();
+    }
+    if ( report_file ) {
+        writeReport( report_file, replay_file || seeded ? "deterministic" : num_workers ? "pool" : "threaded" );
+    }
+    if ( config.topology != TOPOLOGY_NONE ) {
+        printLatencySummary();
+    }
+    if ( config.directory != DIR_FULL_MAP || print_stats ) {
+        printDirectorySummary();
+    }
+    if ( sweep_result_fd >= 0 ) {
+        sendSweepResult( input_dir );
+    }
+
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        pthread_mutex_destroy( &node_waiters[ idx ].mutex );
+        pthread_cond_destroy( &node_waiters[ idx ].wakeup );
+        free( outboxes[ idx ].sends );
+        free( outboxes[ idx ].deferred );
+        free( outboxes[ idx ].blocked );
+        free( latency_logs[ idx ].samples );
+        freeProcessor( &nodes[ idx ] );
+    }
+    munmap( message_buffers, ring_bytes );
+    free( nodes );
+    free( node_waiters );
+    free( node_stats );
+    free( outboxes );
+    free( latency_logs );
+    free( link_slots );
+    free( pin_cpus );
+
+    return EXIT_SUCCESS;
 }
 
-void printProcessorState(int processorId, processorNode node) {
-    // IMPORTANT: DO NOT MODIFY
-    static const char *cacheStateStr[] = { "MODIFIED", "EXCLUSIVE", "SHARED",
-                                           "INVALID" };
-    static const char *dirStateStr[] = { "EM", "S", "U" };
+// one OpenMP thread per node, each draining its own ring and issuing its trace
+void runThreaded( char *input_dir ) {
+    omp_set_num_threads( config.num_procs );
 
-    char filename[32];
-    snprintf(filename, sizeof(filename), "core_%d_output.txt", processorId);
+    #pragma omp parallel
+    {
+        int current_thread = omp_get_thread_num();
+        processorNode *node = &nodes[ current_thread ];
+        pinThread( current_thread );
+        initMessageBuffer( &message_buffers[ current_thread ] );
+        initializeProcessor( current_thread, node, input_dir );
+        if ( restore_file ) {
+            #pragma omp barrier
+            #pragma omp single
+            restoreCheckpoint( restore_file, input_dir );
+        }
+        #pragma omp barrier
+#if NODE_COUNTERS
+        long long start_ns = nowNanos();
+#endif
 
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        printf("Error: Could not open file %s\n", filename);
-        return;
+        while ( true ) {
+            flushOutbox( current_thread );
+
+            while ( drainMessages( current_thread, MSG_BUFFER_SIZE ) > 0 ) {
+            }
+
+            if ( simulationFinished() ) {
+                break;
+            }
+
+            if ( node->awaiting_response > 0 ) {
+                waitForMessages( current_thread );
+                continue;
+            }
+
+            if ( node->done || !issueInstruction( current_thread ) ) {
+                if ( !node->done ) {
+                    node->done = true;
+                    retireNode();
+                } else {
+                    waitForMessages( current_thread );
+                }
+                continue;
+            }
+        }
+
+        COUNT( current_thread, total_ns, nowNanos() - start_ns );
+        takeSnapshot( current_thread, true );
     }
+}
 
-    fprintf(file, "=======================================\n");
-    fprintf(file, " Processor Node: %d\n", processorId);
-    fprintf(file, "=======================================\n\n");
+// single-threaded discrete-event engine: nodes only act when the scheduler
+// says so, either in the recorded issue order of an instruction_order.txt or
+// in an order drawn from a seeded generator, so every run is identical
+void runDeterministic( char *input_dir, const char *order_file, unsigned int seed ) {
+    pinThread( 0 );
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        initMessageBuffer( &message_buffers[ idx ] );
+        initializeProcessor( idx, &nodes[ idx ], input_dir );
+    }
 
-    // Print memory state
-    fprintf(file, "-------- Memory State --------\n");
-    fprintf(file, "| Index | Address |   Value  |\n");
-    fprintf(file, "|----------------------------|\n");
-    for (int i = 0; i < MEM_SIZE; i++) {
-        fprintf(file, "|  %3d  |  0x%02X   |  %5d   |\n", i, (processorId << 4) + i,
-                node.memory[i]);
+    // a restored seeded run with the checkpoint's seed picks up its sequence,
+    // so it ends exactly like the run that wrote the checkpoint
+    unsigned int random_state = seed * 2654435761u + 1;
+    long long issued = 0;
+    if ( restore_file ) {
+        restoreCheckpoint( restore_file, input_dir );
+        issued = restored_issued;
+        if ( !order_file && restored_seeded && restored_seed == seed ) {
+            random_state = restored_random_state;
+        }
     }
-    fprintf(file, "------------------------------\n\n");
 
-    // Print directory state
-    fprintf(file, "------------ Directory State ---------------\n");
-    fprintf(file, "| Index | Address | State |    BitVector   |\n");
-    fprintf(file, "|------------------------------------------|\n");
-    for (int i = 0; i < MEM_SIZE; i++) {
-        fprintf(file, "|  %3d  |  0x%02X   |  %2s   |   0x%08B   |\n",
-                i, (processorId << 4) + i, dirStateStr[node.directory[i].state],
-                node.directory[i].bitVector);
+    if ( order_file ) {
+        FILE *order = fopen( order_file, "r" );
+        if ( !order ) {
+            fprintf( stderr, "Error: could not open %s\n", order_file );
+            exit( EXIT_FAILURE );
+        }
+
+        // the network is drained before every issue, so a node is never
+        // still waiting on a reply when its turn comes
+        char line[ 128 ];
+        int line_number = 0;
+        while ( fgets( line, sizeof( line ), order ) ) {
+            int node_id;
+            char type;
+            unsigned int address, value;
+            line_number++;
+            if ( sscanf( line, "Processor %d: instr type=%c, address=0x%x, value=%u",
+                         &node_id, &type, &address, &value ) != 4 ) {
+                continue;
+            }
+            // a restored run already issued the start of the order
+            if ( restored_issued > 0 ) {
+                restored_issued--;
+                continue;
+            }
+
+            drainNetwork();
+            if ( node_id < 0 || node_id >= config.num_procs ||
+                 nodes[ node_id ].done || !issueInstruction( node_id ) ||
+                 nodes[ node_id ].current_instr.type != type ||
+                 nodes[ node_id ].current_instr.address != address ||
+                 ( type == 'W' && nodes[ node_id ].current_instr.value != value ) ) {
+                fprintf( stderr, "Error: %s:%d does not match the trace of processor %d\n",
+                         order_file, line_number, node_id );
+                exit( EXIT_FAILURE );
+            }
+            if ( ++issued == checkpoint_at && checkpoint_file ) {
+                writeCheckpoint( checkpoint_file, input_dir, issued, false, seed, random_state );
+            }
+        }
+        fclose( order );
     }
-    fprintf(file, "--------------------------------------------\n\n");
-    
-    // Print cache state
-    fprintf(file, "------------ Cache State ----------------\n");
-    fprintf(file, "| Index | Address | Value |    State    |\n");
-    fprintf(file, "|---------------------------------------|\n");
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        fprintf(file, "|  %3d  |  0x%02X   |  %3d  |  %8s \t|\n",
-               i, node.cache[i].address, node.cache[i].value,
-               cacheStateStr[node.cache[i].state]);
+
+    // whatever the order file did not cover, or the whole run when seeded
+    int *ready = allocOrDie( 2 * config.num_procs, sizeof( int ) );
+    while ( true ) {
+        // every node with a message to handle or an instruction to issue is a
+        // candidate, even entries are deliveries and odd entries are issues
+        int candidates = 0;
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            flushOutbox( idx );
+            if ( hasMessages( idx ) ) {
+                ready[ candidates++ ] = 2 * idx;
+            }
+            if ( !nodes[ idx ].done && !nodes[ idx ].awaiting_response ) {
+                ready[ candidates++ ] = 2 * idx + 1;
+            }
+        }
+        if ( candidates == 0 ) {
+            break;
+        }
+
+        int pick = ready[ order_file ? 0 : nextRandom( &random_state ) % candidates ];
+        int node_id = pick / 2;
+        if ( pick % 2 == 0 ) {
+            deliverOneMessage( node_id );
+        } else if ( !issueInstruction( node_id ) ) {
+            nodes[ node_id ].done = true;
+            retireNode();
+        } else if ( ++issued == checkpoint_at && checkpoint_file ) {
+            writeCheckpoint( checkpoint_file, input_dir, issued, !order_file, seed, random_state );
+        }
     }
-    fprintf(file, "----------------------------------------\n\n");
+    free( ready );
 
-    fclose(file);
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        takeSnapshot( idx, true );
+    }
 }
 
-// --- IMPORTANT: DO NOT MODIFY --
\ No newline at end of file
+// a fixed pool of workers multiplexes the nodes. A node is runnable while it
+// has messages, deferred sends or an instruction it may issue; whoever makes
+// it runnable queues it on their own deque and idle workers steal. On a timed
+// network nodes only issue inside a conservative window one lookahead ( the
+// fastest possible delivery ) past the slowest node, so no clock runs ahead of
+// traffic that could still reach it by more than that
+void runPool( char *input_dir ) {
+    int capacity = 1;
+    while ( capacity < config.num_procs ) {
+        capacity *= 2;
+    }
+    deque_mask = capacity - 1;
+    work_deques = allocLinesOrDie( num_workers, sizeof( workDeque ) );
+    node_scheduled = allocOrDie( config.num_procs, sizeof( atomic_int ) );
+    for ( int worker = 0; worker < num_workers; worker++ ) {
+        atomic_init( &work_deques[ worker ].top, 0 );
+        atomic_init( &work_deques[ worker ].bottom, 0 );
+        work_deques[ worker ].items = allocOrDie( capacity, sizeof( atomic_int ) );
+    }
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        atomic_init( &node_scheduled[ idx ], 0 );
+    }
+    atomic_init( &ready_nodes, 0 );
+    pool_finished = false;
+
+    #pragma omp parallel num_threads( num_workers )
+    {
+        int worker = omp_get_thread_num();
+        unsigned int victim_state = 2463534242u + worker;
+        // nodes held back because they only had sends for full rings, their
+        // receivers sit further down the deque and have to run first
+        int *stalled = allocOrDie( config.num_procs, sizeof( int ) );
+        int stalled_count = 0;
+        pinThread( worker );
+
+        // nodes migrate between workers, so this only spreads their pages
+        // over the workers' NUMA nodes instead of piling them on the first
+        #pragma omp for schedule( static )
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            initMessageBuffer( &message_buffers[ idx ] );
+            initializeProcessor( idx, &nodes[ idx ], input_dir );
+        }
+
+        #pragma omp single
+        {
+            if ( restore_file ) {
+                restoreCheckpoint( restore_file, input_dir );
+            }
+            pool_finished = !advanceWindow();
+        }
+
+        while ( !pool_finished ) {
+            int node_id;
+            bool found = dequePop( &work_deques[ worker ], &node_id );
+
+            int start = nextRandom( &victim_state ) % num_workers;
+            for ( int offset = 0; offset < num_workers && !found; offset++ ) {
+                int victim = ( start + offset ) % num_workers;
+                found = victim != worker && dequeSteal( &work_deques[ victim ], &node_id );
+            }
+            if ( found ) {
+                if ( runNode( node_id, worker ) ) {
+                    stalled[ stalled_count++ ] = node_id;
+                }
+                continue;
+            }
+
+            if ( stalled_count > 0 ) {
+                while ( stalled_count > 0 ) {
+                    dequePush( &work_deques[ worker ], stalled[ --stalled_count ] );
+                }
+                sched_yield();
+                continue;
+            }
+
+            // nothing queued or running anywhere: the window is exhausted
+            if ( atomic_load( &ready_nodes ) == 0 ) {
+                #pragma omp barrier
+                #pragma omp single
+                pool_finished = !advanceWindow();
+                continue;
+            }
+            sched_yield();
+        }
+        free( stalled );
+    }
+
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        takeSnapshot( idx, true );
+    }
+    for ( int worker = 0; worker < num_workers; worker++ ) {
+        free( work_deques[ worker ].items );
+    }
+    free( work_deques );
+    free( node_scheduled );
+}
+
+// runs up to NODE_QUANTUM events of a node the worker holds, then queues it
+// again or lets it go. Returns true, keeping the node, when nothing could be
+// done but retry sends
+bool runNode( int node_id, int worker ) {
+    processorNode *node = &nodes[ node_id ];
+    messageBuffer *msg_buf = &message_buffers[ node_id ];
+    int deferred = outboxes[ node_id ].count;
+    int events;
+
+    for ( events = 0; events < NODE_QUANTUM; events++ ) {
+        flushOutbox( node_id );
+        int drained = drainMessages( node_id, NODE_QUANTUM - events );
+        if ( drained > 0 ) {
+            events += drained - 1;
+            continue;
+        }
+        if ( node->done || node->awaiting_response || node->clock >= window_end ) {
+            break;
+        }
+        if ( !issueInstruction( node_id ) ) {
+            node->done = true;
+            retireNode();
+            break;
+        }
+    }
+
+    if ( hasMessages( node_id ) ||
+         ( !node->done && !node->awaiting_response && node->clock < window_end ) ) {
+        dequePush( &work_deques[ worker ], node_id );
+        return false;
+    }
+    if ( outboxes[ node_id ].count > 0 ) {
+        if ( events == 0 && outboxes[ node_id ].count == deferred ) {
+            return true;
+        }
+        dequePush( &work_deques[ worker ], node_id );
+        return false;
+    }
+
+    // a sender that still saw the flag set did not queue the node, so look
+    // at the ring once more after letting go; only the slot is read, the
+    // head stays with whoever holds the node next
+    size_t head = msg_buf->head;
+    atomic_store( &node_scheduled[ node_id ], 0 );
+    atomic_thread_fence( memory_order_seq_cst );
+    messageSlot *slot = &msg_buf->slots[ head & ( MSG_BUFFER_SIZE - 1 ) ];
+    if ( atomic_load_explicit( &slot->sequence, memory_order_acquire ) == head + 1 ) {
+        scheduleNode( node_id, worker );
+    }
+    atomic_fetch_sub( &ready_nodes, 1 );
+    return false;
+}
+
+void scheduleNode( int node_id, int worker ) {
+    if ( atomic_exchange( &node_scheduled[ node_id ], 1 ) ) {
+        return;
+    }
+    atomic_fetch_add( &ready_nodes, 1 );
+    dequePush( &work_deques[ worker ], node_id );
+}
+
+// called by a single worker while the others wait at the barrier: opens the
+// next window at the slowest node that can still issue and queues everything
+// runnable in it, false once nothing is
+bool advanceWindow() {
+    long long slowest = LLONG_MAX;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        if ( !nodes[ idx ].done && !nodes[ idx ].awaiting_response && nodes[ idx ].clock < slowest ) {
+            slowest = nodes[ idx ].clock;
+        }
+    }
+    // nothing sent between two nodes arrives sooner than one flit over the
+    // shortest route, which is what the window may run ahead by
+    if ( config.topology != TOPOLOGY_NONE && slowest != LLONG_MAX ) {
+        int min_hops = config.topology == TOPOLOGY_CROSSBAR ? 2 : 1;
+        window_end = slowest + min_hops * config.hop_latency + 1;
+    }
+
+    bool queued = false;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        if ( hasMessages( idx ) || outboxes[ idx ].count > 0 ||
+             ( !nodes[ idx ].done && !nodes[ idx ].awaiting_response &&
+               nodes[ idx ].clock < window_end ) ) {
+            scheduleNode( idx, idx % num_workers );
+            queued = true;
+        }
+    }
+    return queued;
+}
+
+void dequePush( workDeque *deque, int node_id ) {
+    long long bottom = atomic_load_explicit( &deque->bottom, memory_order_relaxed );
+    atomic_store_explicit( &deque->items[ bottom & deque_mask ], node_id, memory_order_relaxed );
+    atomic_thread_fence( memory_order_release );
+    atomic_store_explicit( &deque->bottom, bottom + 1, memory_order_relaxed );
+}
+
+bool dequePop( workDeque *deque, int *node_id ) {
+    long long bottom = atomic_load_explicit( &deque->bottom, memory_order_relaxed ) - 1;
+    atomic_store_explicit( &deque->bottom, bottom, memory_order_relaxed );
+    atomic_thread_fence( memory_order_seq_cst );
+    long long top = atomic_load_explicit( &deque->top, memory_order_relaxed );
+
+    if ( top > bottom ) {
+        atomic_store_explicit( &deque->bottom, bottom + 1, memory_order_relaxed );
+        return false;
+    }
+    *node_id = atomic_load_explicit( &deque->items[ bottom & deque_mask ], memory_order_relaxed );
+    if ( top == bottom ) {
+        // last item, race the thieves for it
+        bool won = atomic_compare_exchange_strong_explicit( &deque->top, &top, top + 1,
+                                                            memory_order_seq_cst,
+                                                            memory_order_relaxed );
+        atomic_store_explicit( &deque->bottom, bottom + 1, memory_order_relaxed );
+        return won;
+    }
+    return true;
+}
+
+bool dequeSteal( workDeque *deque, int *node_id ) {
+    long long top = atomic_load_explicit( &deque->top, memory_order_acquire );
+    atomic_thread_fence( memory_order_seq_cst );
+    long long bottom = atomic_load_explicit( &deque->bottom, memory_order_acquire );
+
+    if ( top >= bottom ) {
+        return false;
+    }
+    *node_id = atomic_load_explicit( &deque->items[ top & deque_mask ], memory_order_relaxed );
+    return atomic_compare_exchange_strong_explicit( &deque->top, &top, top + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed );
+}
+
+bool deliverOneMessage( int node_id ) {
+    message incoming_msg;
+    if ( !dequeueMessage( &message_buffers[ node_id ], &incoming_msg ) ) {
+        return false;
+    }
+    handleMessage( node_id, incoming_msg );
+    retireMessages( 1 );
+    return true;
+}
+
+// takes whatever is queued for the node, up to max_count, off the ring in one
+// go and handles it, returning how many messages were taken. The whole batch
+// is retired at once, after every reply it caused has been queued
+int drainMessages( int node_id, int max_count ) {
+    message batch[ MSG_BUFFER_SIZE ];
+    int count = dequeueBatch( &message_buffers[ node_id ], batch,
+                              max_count < MSG_BUFFER_SIZE ? max_count : MSG_BUFFER_SIZE );
+    if ( count == 0 ) {
+        return 0;
+    }
+    COUNT( node_id, drain_batches, 1 );
+    COUNT( node_id, drained_messages, count );
+
+    for ( int idx = 0; idx < count; idx++ ) {
+        if ( coalesceMessage( node_id, batch, idx, count ) ) {
+            COUNT( node_id, msgs_received[ batch[ idx ].type ], 1 );
+            if ( config.topology != TOPOLOGY_NONE && batch[ idx ].timestamp > nodes[ node_id ].clock ) {
+                nodes[ node_id ].clock = batch[ idx ].timestamp;
+            }
+            continue;
+        }
+        handleMessage( node_id, batch[ idx ] );
+    }
+    retireMessages( count );
+    return count;
+}
+
+// true when batch[ idx ] can be dropped because a later message in the batch
+// for the same block has the same effect. Only the next message for the block
+// is considered, so nothing else can touch the block in between
+bool coalesceMessage( int node_id, const message *batch, int idx, int count ) {
+    const message *msg = &batch[ idx ];
+    if ( msg->type != INV && msg->type != EVICT_SHARED ) {
+        return false;
+    }
+
+    const message *next = NULL;
+    int last = idx + COALESCE_WINDOW < count ? idx + COALESCE_WINDOW : count - 1;
+    for ( int later = idx + 1; later <= last && !next; later++ ) {
+        if ( batch[ later ].address == msg->address ) {
+            next = &batch[ later ];
+        }
+    }
+    if ( !next ) {
+        return false;
+    }
+
+    // the second INV would only find the line already invalid
+    if ( msg->type == INV ) {
+        if ( next->type != INV ) {
+            return false;
+        }
+        COUNT( node_id, coalesced_invalidations, 1 );
+        return true;
+    }
+
+    // a sharer that evicted a block and asks for it straight back can stay in
+    // the sharer set, as long as the eviction would not have left a single
+    // sharer to promote. Only the exact encodings can tell
+    if ( next->type != READ_REQUEST || next->sender != msg->sender ||
+         homeNode( msg->address ) != node_id ||
+         ( config.directory != DIR_FULL_MAP && config.directory != DIR_SPARSE ) ) {
+        return false;
+    }
+    processorNode *node = &nodes[ node_id ];
+    int dir = directorySlot( node_id, memIndex( msg->address ), false );
+    if ( dir < 0 || node->directory[ dir ].state != S || directoryCount( node, dir ) < 3 ) {
+        return false;
+    }
+    sharerSet sharers = directorySharers( node, dir );
+    if ( !( sharers.words[ msg->sender / 64 ] & ( 1ULL << ( msg->sender % 64 ) ) ) ) {
+        return false;
+    }
+    COUNT( node_id, coalesced_evictions, 1 );
+    return true;
+}
+
+// round-robin over the nodes, one message each per pass, until nothing is left
+void drainNetwork() {
+    bool progress = true;
+    while ( progress ) {
+        progress = false;
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            flushOutbox( idx );
+            progress |= deliverOneMessage( idx );
+        }
+    }
+}
+
+unsigned int nextRandom( unsigned int *state ) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// applies one incoming message to the node, shared by every engine
+void handleMessage( int current_thread, message incoming_msg ) {
+    processorNode *node = &nodes[ current_thread ];
+    message response_msg;
+
+    int target_node = homeNode( incoming_msg.address );
+    int mem_location = memIndex( incoming_msg.address );
+    int cache_slot;
+    int dir;
+    COUNT( current_thread, msgs_received[ incoming_msg.type ], 1 );
+    if ( config.topology != TOPOLOGY_NONE ) {
+        if ( incoming_msg.timestamp > node->clock ) {
+            node->clock = incoming_msg.timestamp;
+        }
+        node->clock += NODE_CYCLES;
+    }
+    if ( holdMessage( current_thread, incoming_msg ) ) {
+        return;
+    }
+
+    // a write leaves the rest of a wider line alone, so an UPGRADE whose copy
+    // another writer took first needs that rest from the new owner
+    if ( incoming_msg.type == UPGRADE && config.line_size > 1 ) {
+        dir = directorySlot( current_thread, mem_location, true );
+        if ( node->directory[ dir ].state == EM && directoryFirst( node, dir ) != incoming_msg.sender ) {
+            incoming_msg.type = WRITE_REQUEST;
+        }
+    }
+
+    switch ( incoming_msg.type ) {
+        case WRITE_REQUEST:
+            dir = directorySlot( current_thread, mem_location, true );
+            dropLostOwner( node, dir );
+            if (node->directory[ dir ].state == U) {
+                response_msg = (message) {
+                    .type = REPLY_WR,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                };
+                memcpy( response_msg.data, &node->memory[ mem_location ], config.line_size );
+
+                sendMessage( incoming_msg.sender, response_msg );
+            } else if (node->directory[ dir ].state == O && config.line_size > 1 &&
+                       node->dir_owners[ dir ] != incoming_msg.sender) {
+                // memory is stale, the owner hands the writer the rest of the
+                // line while the home invalidates the other sharers
+                int owner = node->dir_owners[ dir ];
+                sharerSet others = directoryExcept( node, dir, incoming_msg.sender );
+                sharersRemove( others.words, owner );
+                for (int word = 0; word < config.sharer_words; word++) {
+                    for (uint64_t bits = others.words[ word ]; bits; bits &= bits - 1) {
+                        response_msg = (message) {
+                            .type = INV,
+                            .sender = current_thread,
+                            .address = incoming_msg.address,
+                        };
+                        sendMessage( word * 64 + __builtin_ctzll( bits ), response_msg );
+                        COUNT( current_thread, invalidations_sent, 1 );
+                    }
+                }
+                response_msg = (message) {
+                    .type = WRITEBACK_INV,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .secondReceiver = incoming_msg.sender,
+                    .transfer = pendingTransfer( node, dir, owner ),
+                };
+                sendMessage( owner, response_msg );
+                if (node->dir_transfers) {
+                    node->dir_transfers[ dir ] = incoming_msg.sender;
+                }
+            } else if (node->directory[ dir ].state == S || node->directory[ dir ].state == O) {
+                response_msg = (message) {
+                    .type = REPLY_ID,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .bitVector = directoryExcept( node, dir, incoming_msg.sender ),
+                };
+                memcpy( response_msg.data, &node->memory[ mem_location ], config.line_size );
+                sendMessage( incoming_msg.sender, response_msg );
+            } else if (node->directory[ dir ].state == EM) {
+                int previous_owner = directoryFirst( node, dir );
+                response_msg = (message) {
+                    .type = WRITEBACK_INV,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .secondReceiver = incoming_msg.sender,
+                    .transfer = pendingTransfer( node, dir, previous_owner ),
+                };
+                sendMessage( previous_owner, response_msg );
+                if (node->dir_transfers) {
+                    node->dir_transfers[ dir ] = incoming_msg.sender;
+                }
+            }
+
+            node->directory[ dir ].state = EM;
+            directoryClear( node, dir );
+            directoryAdd( node, dir, incoming_msg.sender );
+
+            break;
+
+        case READ_REQUEST:
+            dir = directorySlot( current_thread, mem_location, true );
+            dropLostOwner( node, dir );
+            if (node->directory[ dir ].state == EM) {
+                int previous_owner = directoryFirst( node, dir );
+                response_msg = (message) {
+                    .type = WRITEBACK_INT,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .secondReceiver = incoming_msg.sender,
+                    .transfer = pendingTransfer( node, dir, previous_owner ),
+                };
+                sendMessage( previous_owner, response_msg );
+
+                // under MOESI the owner keeps the block and serves the reader
+                // itself, so the home records both now instead of on a FLUSH
+                if (config.protocol == PROTOCOL_MOESI) {
+                    node->directory[ dir ].state = O;
+                    node->dir_owners[ dir ] = previous_owner;
+                    directoryAdd( node, dir, incoming_msg.sender );
+                }
+            } else if (node->directory[ dir ].state == O) {
+                response_msg = (message) {
+                    .type = WRITEBACK_INT,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .secondReceiver = incoming_msg.sender,
+                    .transfer = pendingTransfer( node, dir, node->dir_owners[ dir ] ),
+                };
+                sendMessage( node->dir_owners[ dir ], response_msg );
+                directoryAdd( node, dir, incoming_msg.sender );
+            } else if (node->directory[ dir ].state == S) {
+                response_msg = (message) {
+                    .type = REPLY_RD,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .dirState = S
+                };
+                memcpy( response_msg.data, &node->memory[ mem_location ], config.line_size );
+                sendMessage( incoming_msg.sender, response_msg );
+                directoryAdd( node, dir, incoming_msg.sender );
+            } else if (node->directory[ dir ].state == U) {
+                response_msg = (message) {
+                    .type = REPLY_RD,
+                    .sender = current_thread,
+                    .address = incoming_msg.address,
+                    .dirState = EM
+                };
+                memcpy( response_msg.data, &node->memory[ mem_location ], config.line_size );
+                sendMessage( incoming_msg.sender, response_msg );
+                node->directory[ dir ].state = EM;
+                directoryClear( node, dir );
+                directoryAdd( node, dir, incoming_msg.sender );
+            }
+            break;
+
+        case REPLY_RD:
+            fillMiss( current_thread, incoming_msg.address, incoming_msg.data,
+                      (incoming_msg.dirState == S) ? SHARED : EXCLUSIVE );
+            completeMiss( current_thread, incoming_msg.address, incoming_msg.type );
+            break;
+
+        case WRITEBACK_INT:
+            cache_slot = cacheLocate( node, incoming_msg.address );
+            response_msg = (message) {
+                .type = FLUSH,
+                .sender = current_thread,
+                .address = incoming_msg.address,
+                .secondReceiver = incoming_msg.secondReceiver,
+            };
+            if (cache_slot >= 0) {
+                cacheReadLine( node, cache_slot, response_msg.data );
+            }
+            if (config.protocol == PROTOCOL_MOESI) {
+                // only the reader gets the data, a dirty copy stays OWNED and
+                // a clean one SHARED, memory is not written
+                response_msg.dirState = O;
+                sendMessage( incoming_msg.secondReceiver, response_msg );
+                if (cache_slot >= 0) {
+                    cacheLineState state = node->cache_states[ cache_slot ];
+                    node->cache_states[ cache_slot ] = state == MODIFIED || state == OWNED ? OWNED : SHARED;
+                }
+                break;
+            }
+            sendMessage( target_node, response_msg );
+
+            if (target_node != incoming_msg.secondReceiver)
+                sendMessage( incoming_msg.secondReceiver, response_msg );
+
+            if (cache_slot >= 0) {
+                node->cache_states[ cache_slot ] = SHARED;
+            }
+            break;
+
+        case FLUSH:
+            // an owner's FLUSH under MOESI only goes to the reader
+            if (current_thread == target_node && incoming_msg.dirState != O) {
+                dir = directorySlot( current_thread, mem_location, true );
+                node->directory[ dir ].state = S;
+                directoryAdd( node, dir, incoming_msg.secondReceiver );
+                memcpy( &node->memory[ mem_location ], incoming_msg.data, config.line_size );
+                COUNT( current_thread, memory_writebacks, 1 );
+            }
+
+            if (current_thread == incoming_msg.secondReceiver) {
+                fillMiss( current_thread, incoming_msg.address, incoming_msg.data, SHARED );
+            }
+
+            // the blocking cache has always let the home's copy end its own wait too
+            if (current_thread == incoming_msg.secondReceiver || !config.mshrs) {
+                completeMiss( current_thread, incoming_msg.address, incoming_msg.type );
+            }
+            break;
+
+        case UPGRADE:
+            dir = directorySlot( current_thread, mem_location, true );
+            response_msg = (message) {
+                .type = REPLY_ID,
+                .sender = current_thread,
+                .address = incoming_msg.address,
+                .bitVector = directoryExcept( node, dir, incoming_msg.sender ),
+            };
+            memcpy( response_msg.data, &node->memory[ mem_location ], config.line_size );
+            sendMessage( incoming_msg.sender, response_msg );
+
+            node->directory[ dir ].state = EM;
+            directoryClear( node, dir );
+            directoryAdd( node, dir, incoming_msg.sender );
+
+            break;
+
+        case REPLY_ID:
+            // walk only the set bits instead of testing every node
+            for (int word = 0; word < config.sharer_words; word++) {
+                uint64_t sharers = incoming_msg.bitVector.words[ word ];
+                while (sharers) {
+                    response_msg = (message) {
+                        .type = INV,
+                        .sender = current_thread,
+                        .address = incoming_msg.address,
+                    };
+                    sendMessage( word * 64 + __builtin_ctzll( sharers ), response_msg );
+                    COUNT( current_thread, invalidations_sent, 1 );
+                    sharers &= sharers - 1;
+                }
+            }
+
+            // a copy the node still holds is kept, under MOESI it may be
+            // newer than the memory the home sent
+            cache_slot = cacheFind( node, incoming_msg.address );
+            if (cache_slot >= 0 && node->cache_states[ cache_slot ] != INVALID) {
+                cacheReadLine( node, cache_slot, incoming_msg.data );
+            }
+            fillWrite( current_thread, incoming_msg.address, incoming_msg.data );
+            completeMiss( current_thread, incoming_msg.address, incoming_msg.type );
+            break;
+
+        case INV:
+            cache_slot = cacheFind( node, incoming_msg.address );
+            if (cache_slot >= 0 && node->cache_states[ cache_slot ] != INVALID) {
+                // a sparse directory recalling its entry marks the INV with U,
+                // dirty data then goes home the way an eviction would send it.
+                // A writer's INV just drops the copy, the write replaces it,
+                // unless a wider line is dirty with its neighbours' writes
+                bool dirty = node->cache_states[ cache_slot ] == MODIFIED ||
+                             node->cache_states[ cache_slot ] == OWNED;
+                if (dirty && (incoming_msg.dirState == U ||
+                              (config.line_size > 1 && node->cache_states[ cache_slot ] == MODIFIED))) {
+                    handleCacheReplacement( current_thread, cacheLineAt( node, cache_slot ) );
+                }
+                node->cache_states[ cache_slot ] = INVALID;
+            } else {
+                COUNT( current_thread, useless_invalidations, 1 );
+            }
+            markInvalidated( node, incoming_msg.address );
+            break;
+
+        case REPLY_WR:
+            // the blocking cache has always handed back what the line held
+            // first, even its own stale copy of the block, as the reference does
+            if (!config.mshrs && (cache_slot = cacheFind( node, incoming_msg.address )) >= 0) {
+                handleCacheReplacement( current_thread, cacheLineAt( node, cache_slot ) );
+            }
+            fillWrite( current_thread, incoming_msg.address, incoming_msg.data );
+            completeMiss( current_thread, incoming_msg.address, incoming_msg.type );
+            break;
+
+        case WRITEBACK_INV:
+            cache_slot = cacheLocate( node, incoming_msg.address );
+            response_msg = (message) {
+                .type = FLUSH_INVACK,
+                .sender = current_thread,
+                .address = incoming_msg.address,
+                .secondReceiver = incoming_msg.secondReceiver,
+            };
+            if (cache_slot >= 0) {
+                cacheReadLine( node, cache_slot, response_msg.data );
+            }
+            sendMessage( target_node, response_msg );
+            sendMessage( incoming_msg.secondReceiver, response_msg );
+
+            if (cache_slot >= 0) {
+                node->cache_states[ cache_slot ] = INVALID;
+            }
+
+            break;
+
+        case FLUSH_INVACK:
+            if (current_thread == target_node) {
+                dir = directorySlot( current_thread, mem_location, true );
+                directoryClear( node, dir );
+                directoryAdd( node, dir, incoming_msg.secondReceiver );
+                memcpy( &node->memory[ mem_location ], incoming_msg.data, config.line_size );
+                COUNT( current_thread, memory_writebacks, 1 );
+                if (pendingTransfer( node, dir, incoming_msg.secondReceiver )) {
+                    node->dir_transfers[ dir ] = -1;
+                }
+            }
+
+            if (current_thread == incoming_msg.secondReceiver) {
+                fillWrite( current_thread, incoming_msg.address, incoming_msg.data );
+            }
+
+            if (current_thread == incoming_msg.secondReceiver || !config.mshrs) {
+                completeMiss( current_thread, incoming_msg.address, incoming_msg.type );
+            }
+            break;
+
+        case EVICT_SHARED:
+            if (current_thread != target_node) {
+                promoteLastSharer( node, incoming_msg.address );
+            } else if ((dir = directorySlot( current_thread, mem_location, false )) >= 0) {
+                // a sparse directory may have dropped the entry already. An
+                // owner evicting a SHARED copy was clean, memory is current
+                if (node->directory[ dir ].state == O && node->dir_owners[ dir ] == incoming_msg.sender) {
+                    node->directory[ dir ].state = S;
+                }
+                removeSharer( current_thread, dir, incoming_msg.address, incoming_msg.sender );
+            }
+            break;
+
+        case EVICT_MODIFIED:
+            memcpy( &node->memory[ mem_location ], incoming_msg.data, config.line_size );
+            COUNT( current_thread, memory_writebacks, 1 );
+            dir = directorySlot( current_thread, mem_location, false );
+            if (dir >= 0 && node->directory[ dir ].state == O) {
+                // the owner's write back leaves the sharers with clean copies
+                node->directory[ dir ].state = S;
+                removeSharer( current_thread, dir, incoming_msg.address, incoming_msg.sender );
+            } else if (dir >= 0 && !(config.mshrs && node->directory[ dir ].state == EM &&
+                                     directoryFirst( node, dir ) != incoming_msg.sender)) {
+                // with MSHRs, unless a write already handed the block on and
+                // this is the old owner's copy. The blocking cache keeps the
+                // reference behaviour and clears the entry
+                directoryClear( node, dir );
+                node->directory[ dir ].state = U;
+            }
+            break;
+    }
+
+    // a stalled node's next access may have stopped hitting, or started to
+    if ( config.mshrs ) {
+        checkStall( current_thread );
+    }
+    countEvent( current_thread );
+}
+
+// drops an evicted copy from a home's entry, a single sharer left behind is
+// told it now holds the only copy
+void removeSharer( int node_id, int dir, memAddress address, int sharer ) {
+    processorNode *node = &nodes[ node_id ];
+    directoryRemove( node, dir, sharer );
+
+    int sharer_count = directoryCount( node, dir );
+    if ( sharer_count == 0 ) {
+        node->directory[ dir ].state = U;
+    } else if ( sharer_count == 1 ) {
+        node->directory[ dir ].state = EM;
+
+        int new_owner = directoryFirst( node, dir );
+        if ( new_owner < 0 ) {
+            node->directory[ dir ].state = U;
+        } else if ( new_owner != node_id ) {
+            message promote_msg = {
+                .type = EVICT_SHARED,
+                .sender = node_id,
+                .address = address,
+            };
+            sendMessage( new_owner, promote_msg );
+        } else {
+            promoteLastSharer( node, address );
+        }
+    }
+}
+
+// an EM entry whose sharer set came up empty, after crossing evictions or
+// an encoding that lost track, has no owner to forward to. Memory is all
+// the home has, so the block is treated as unowned
+void dropLostOwner( processorNode *node, int dir ) {
+    if ( node->directory[ dir ].state == EM && directoryFirst( node, dir ) < 0 ) {
+        node->directory[ dir ].state = U;
+    }
+}
+
+// the last copy becomes EXCLUSIVE, or MODIFIED if it was an OWNED dirty one
+void promoteLastSharer( processorNode *node, memAddress address ) {
+    int cache_slot = cacheLocate( node, address );
+    if ( cache_slot >= 0 ) {
+        node->cache_states[ cache_slot ] = node->cache_states[ cache_slot ] == OWNED ? MODIFIED : EXCLUSIVE;
+    }
+}
+
+// whether the home forwarded a write to the owner it now names before that
+// owner can have received the block from the one before it
+bool pendingTransfer( processorNode *node, int dir, int owner ) {
+    return node->dir_transfers && node->dir_transfers[ dir ] == owner;
+}
+
+// MSHR tracking the line, -1 when none does ( always with a blocking cache )
+int mshrFind( processorNode *node, memAddress address ) {
+    for ( int entry = 0; entry < config.mshrs; entry++ ) {
+        if ( node->mshrs[ entry ].address == address ) {
+            return entry;
+        }
+    }
+    return -1;
+}
+
+// whether issuing the instruction would take a free MSHR, rather than hit or
+// merge into the miss already outstanding for its block
+bool needsMshr( processorNode *node, instruction instr ) {
+    memAddress line = lineAddress( instr.address );
+    if ( mshrFind( node, line ) >= 0 ) {
+        return false;
+    }
+    int slot = cacheFind( node, line );
+    cacheLineState state = slot >= 0 ? node->cache_states[ slot ] : INVALID;
+    if ( instr.type == 'R' ) {
+        return state == INVALID;
+    }
+    return state != MODIFIED && state != EXCLUSIVE;
+}
+
+void allocateMiss( int node_id, transactionType request, instruction instr, bool prefetch ) {
+    processorNode *node = &nodes[ node_id ];
+    memAddress line = lineAddress( instr.address );
+    int entry = mshrFind( node, config.invalid_address );
+    node->mshrs[ entry ] = (missEntry) {
+        .address = line,
+        .request = request,
+        .write = instr.type == 'W',
+        .prefetch = prefetch,
+        .request_cycle = node->clock,
+    };
+    if ( instr.type == 'W' ) {
+        node->mshrs[ entry ].values[ lineOffset( instr.address ) ] = instr.value;
+        node->mshrs[ entry ].written = 1ULL << lineOffset( instr.address );
+    }
+#if NODE_COUNTERS
+    if ( node->outstanding == 0 ) {
+        node_stats[ node_id ].request_start_ns = nowNanos();
+    }
+#endif
+    node->outstanding++;
+
+    message request_msg = {
+        .type = request,
+        .sender = node_id,
+        .address = line,
+        .data = { instr.value },
+    };
+    sendMessage( homeNode( line ), request_msg );
+    if ( request == UPGRADE ) {
+        COUNT( node_id, upgrades, 1 );
+    }
+    if ( prefetch ) {
+        COUNT( node_id, prefetches, 1 );
+    }
+}
+
+// called on a demand miss for the line, asks for one more line while an MSHR
+// is free: the next one, or with the stride policy the line one stride on
+// once the last two misses were that far apart
+void prefetchAfterMiss( int node_id, memAddress line ) {
+    processorNode *node = &nodes[ node_id ];
+    int stride = config.line_size;
+    if ( config.prefetch == PREFETCH_STRIDE ) {
+        stride = (int) ( line - node->last_miss );
+        bool repeated = stride == node->miss_stride;
+        node->miss_stride = stride;
+        node->last_miss = line;
+        if ( !repeated || stride == 0 ) {
+            return;
+        }
+    }
+
+    // only real blocks, a stride may well run off the end of a home
+    long long target = (long long) line + stride;
+    if ( target < 0 || target >= config.invalid_address ||
+         homeNode( target ) >= config.num_procs || memIndex( target ) >= config.mem_size ||
+         node->outstanding == config.mshrs || mshrFind( node, target ) >= 0 ) {
+        return;
+    }
+    int slot = cacheFind( node, target );
+    if ( slot >= 0 && node->cache_states[ slot ] != INVALID ) {
+        return;
+    }
+    allocateMiss( node_id, READ_REQUEST, (instruction) { .type = 'R', .address = target }, true );
+}
+
+// issue with MSHRs: hits go ahead of outstanding misses, and an access to a
+// block that is already pending joins its miss instead of sending another
+void issueNonBlocking( int node_id, instruction instr, int cache_pos, bool cache_hit ) {
+    processorNode *node = &nodes[ node_id ];
+    memAddress line = lineAddress( instr.address );
+    int entry = mshrFind( node, line );
+
+    // the first use of a prefetched line stands for the miss it saved, so the
+    // prefetcher keeps running ahead of a stream it is following
+    bool missed = entry < 0 && !cache_hit;
+    if ( cache_hit && node->cache_prefetched && node->cache_prefetched[ cache_pos ] ) {
+        node->cache_prefetched[ cache_pos ] = 0;
+        COUNT( node_id, useful_prefetches, 1 );
+        missed = true;
+    }
+
+    if ( entry >= 0 && !( instr.type == 'R' && cache_hit ) ) {
+        // a pending read that also gets written is upgraded once it is filled
+        missEntry *miss = &node->mshrs[ entry ];
+        if ( instr.type == 'W' ) {
+            miss->write = true;
+            miss->values[ lineOffset( instr.address ) ] = instr.value;
+            miss->written |= 1ULL << lineOffset( instr.address );
+        }
+        // a prefetch that was late still saved the access its own request
+        if ( miss->prefetch ) {
+            miss->prefetch = false;
+            COUNT( node_id, useful_prefetches, 1 );
+            missed = true;
+        }
+        COUNT( node_id, merged_misses, 1 );
+    } else if ( instr.type == 'R' ) {
+        if ( !cache_hit ) {
+            allocateMiss( node_id, READ_REQUEST, instr, false );
+        }
+    } else if ( cache_hit && ( node->cache_states[ cache_pos ] == MODIFIED ||
+                               node->cache_states[ cache_pos ] == EXCLUSIVE ) ) {
+        *cacheBlock( node, cache_pos, lineOffset( instr.address ) ) = instr.value;
+        node->cache_states[ cache_pos ] = MODIFIED;
+    } else {
+        allocateMiss( node_id, cache_hit ? UPGRADE : WRITE_REQUEST, instr, false );
+    }
+    if ( missed && config.prefetch != PREFETCH_NONE ) {
+        prefetchAfterMiss( node_id, line );
+    }
+
+    checkStall( node_id );
+    if ( node->awaiting_response ) {
+        COUNT( node_id, mshr_stalls, 1 );
+    }
+}
+
+// with every MSHR busy, looks at the next instruction: the node may go on
+// issuing as long as it only hits or merges
+void checkStall( int node_id ) {
+    processorNode *node = &nodes[ node_id ];
+    node->awaiting_response = 0;
+    if ( node->outstanding < config.mshrs ) {
+        return;
+    }
+    if ( !node->has_next ) {
+        node->has_next = nextInstruction( &node->trace, &node->next_instr );
+    }
+    node->awaiting_response = node->has_next && needsMshr( node, node->next_instr );
+}
+
+// a reply for the block arrived and has been filled. The blocking cache just
+// stops waiting; an MSHR is freed, unless a write merged into a read still
+// needs ownership, and the requests held for the block are handled
+void completeMiss( int node_id, memAddress address, transactionType reply ) {
+    processorNode *node = &nodes[ node_id ];
+    if ( !config.mshrs ) {
+        if ( node->awaiting_response ) {
+            node->awaiting_response = 0;
+#if NODE_COUNTERS
+            COUNT( node_id, response_ns, nowNanos() - node_stats[ node_id ].request_start_ns );
+#endif
+            if ( config.topology != TOPOLOGY_NONE ) {
+                recordMissLatency( node_id, node->request_type, node->request_cycle, reply );
+            }
+        }
+        return;
+    }
+
+    int entry = mshrFind( node, address );
+    if ( entry < 0 ) {
+        return;
+    }
+    missEntry *miss = &node->mshrs[ entry ];
+    if ( config.topology != TOPOLOGY_NONE && !miss->prefetch ) {
+        recordMissLatency( node_id, miss->request, miss->request_cycle, reply );
+    }
+
+    int slot = cacheFind( node, address );
+    if ( slot >= 0 && miss->request == READ_REQUEST && miss->invalidated ) {
+        // the data predates a write, the read may use it but not keep it
+        node->cache_states[ slot ] = INVALID;
+    }
+    cacheLineState state = slot >= 0 ? node->cache_states[ slot ] : INVALID;
+    if ( miss->request == READ_REQUEST && miss->write ) {
+        if ( state != EXCLUSIVE ) {
+            miss->request = state == SHARED ? UPGRADE : WRITE_REQUEST;
+            miss->invalidated = false;
+            miss->request_cycle = node->clock;
+            message request_msg = {
+                .type = miss->request,
+                .sender = node_id,
+                .address = address,
+                .data = { miss->values[ __builtin_ctzll( miss->written ) ] },
+            };
+            sendMessage( homeNode( address ), request_msg );
+            if ( miss->request == UPGRADE ) {
+                COUNT( node_id, upgrades, 1 );
+            }
+            return;
+        }
+        for ( int block = 0; block < config.line_size; block++ ) {
+            if ( miss->written >> block & 1 ) {
+                *cacheBlock( node, slot, block ) = miss->values[ block ];
+            }
+        }
+        node->cache_states[ slot ] = MODIFIED;
+    }
+
+    miss->address = config.invalid_address;
+    node->outstanding--;
+#if NODE_COUNTERS
+    if ( node->outstanding == 0 ) {
+        COUNT( node_id, response_ns, nowNanos() - node_stats[ node_id ].request_start_ns );
+    }
+#endif
+
+    // handled in arrival order, later ones for other blocks stay held
+    int kept = 0;
+    for ( int idx = 0; idx < node->held_count; idx++ ) {
+        message held = node->held[ idx ];
+        if ( held.address != address ) {
+            node->held[ kept++ ] = held;
+            continue;
+        }
+        COUNT( node_id, msgs_received[ held.type ], -1 );   // counted on arrival
+        handleMessage( node_id, held );
+    }
+    node->held_count = kept;
+    checkStall( node_id );
+}
+
+// fills a cache line with the line a miss brought in. With MSHRs a victim
+// that is itself waiting on a miss keeps its line, and the new one goes
+// straight back home as an eviction, just as if it had been replaced right away
+void fillMiss( int node_id, memAddress address, const byte *data, cacheLineState state ) {
+    processorNode *node = &nodes[ node_id ];
+    int slot = cacheSlotFor( node, address );
+    if ( node->cache_tags[ slot ] != address && node->cache_states[ slot ] != INVALID ) {
+        if ( mshrFind( node, node->cache_tags[ slot ] ) >= 0 ) {
+            cacheLine bypass = { .address = address, .state = state };
+            memcpy( bypass.data, data, config.line_size );
+            handleCacheReplacement( node_id, bypass );
+            return;
+        }
+        handleCacheReplacement( node_id, cacheLineAt( node, slot ) );
+    }
+    cacheFill( node, slot, address, data, state );
+
+    int entry = mshrFind( node, address );
+    if ( node->cache_prefetched && entry >= 0 && node->mshrs[ entry ].prefetch ) {
+        node->cache_prefetched[ slot ] = 1;
+    }
+}
+
+// fills a completed write's line MODIFIED, with the blocks written while it
+// was outstanding on top: the blocking cache's last instruction, or every
+// write merged into the line's MSHR
+void fillWrite( int node_id, memAddress address, const byte *data ) {
+    processorNode *node = &nodes[ node_id ];
+    byte line[ MAX_LINE_SIZE ];
+    memcpy( line, data, config.line_size );
+    int entry = mshrFind( node, address );
+    if ( entry >= 0 ) {
+        for ( int block = 0; block < config.line_size; block++ ) {
+            if ( node->mshrs[ entry ].written >> block & 1 ) {
+                line[ block ] = node->mshrs[ entry ].values[ block ];
+            }
+        }
+    } else {
+        line[ lineOffset( node->current_instr.address ) ] = node->current_instr.value;
+    }
+    fillMiss( node_id, address, line, MODIFIED );
+}
+
+void markInvalidated( processorNode *node, memAddress address ) {
+    int entry = mshrFind( node, address );
+    if ( entry >= 0 && node->mshrs[ entry ].request == READ_REQUEST ) {
+        node->mshrs[ entry ].invalidated = true;
+    }
+}
+
+// a request forwarded to a new owner can overtake the FLUSH_INVACK that makes
+// it the owner, it waits until the node's own miss on the block completes.
+// Forwards aimed at a copy the node has since evicted are handled right away,
+// the node's new miss may well depend on them
+bool holdMessage( int node_id, message msg ) {
+    processorNode *node = &nodes[ node_id ];
+    if ( !msg.transfer || mshrFind( node, msg.address ) < 0 ) {
+        return false;
+    }
+    if ( node->held_count == node->held_capacity ) {
+        node->held_capacity = node->held_capacity ? 2 * node->held_capacity : 8;
+        node->held = realloc( node->held, node->held_capacity * sizeof( message ) );
+        if ( !node->held ) {
+            fprintf( stderr, "Error: out of memory\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+    node->held[ node->held_count++ ] = msg;
+    COUNT( node_id, held_messages, 1 );
+    return true;
+}
+
+// fetches and issues the node's next instruction, false once the trace is done
+bool issueInstruction( int current_thread ) {
+    processorNode *node = &nodes[ current_thread ];
+    message request_msg;
+
+    if ( node->has_next ) {
+        node->current_instr = node->next_instr;
+        node->has_next = false;
+    } else if ( !nextInstruction( &node->trace, &node->current_instr ) ) {
+        return false;
+    }
+    instruction current_instr = node->current_instr;
+    node->clock += NODE_CYCLES;
+
+    memAddress line = lineAddress( current_instr.address );
+    int target_proc = homeNode( line );
+    int cache_pos = cacheFind( node, line );
+
+    int cache_hit = cache_pos >= 0 && node->cache_states[ cache_pos ] != INVALID;
+    if ( cache_hit ) {
+        cacheTouch( node, cache_pos );
+        COUNT( current_thread, cache_hits, 1 );
+    } else {
+        COUNT( current_thread, cache_misses, 1 );
+    }
+    if ( current_instr.type == 'R' ) {
+        COUNT( current_thread, reads, 1 );
+    } else {
+        COUNT( current_thread, writes, 1 );
+    }
+    if ( config.mshrs ) {
+        issueNonBlocking( current_thread, current_instr, cache_pos, cache_hit );
+        countEvent( current_thread );
+        return true;
+    }
+
+    if ( current_instr.type == 'R' ) {
+        if (cache_hit) {
+            do { } while (false);
+        } else {
+            request_msg = (message) {
+                .type = READ_REQUEST,
+                .sender = current_thread,
+                .address = line,
+            };
+            sendMessage( target_proc, request_msg );
+            node->awaiting_response = 1;
+        }
+    } else {
+        if (cache_hit) {
+            if (node->cache_states[cache_pos] == MODIFIED ||
+                node->cache_states[cache_pos] == EXCLUSIVE) {
+                *cacheBlock( node, cache_pos, lineOffset( current_instr.address ) ) = current_instr.value;
+                node->cache_states[cache_pos] = MODIFIED;
+            } else {
+                request_msg = (message) {
+                    .type = UPGRADE,
+                    .sender = current_thread,
+                    .address = line,
+                    .data = { current_instr.value }
+                };
+                sendMessage( target_proc, request_msg );
+                node->awaiting_response = 1;
+                COUNT( current_thread, upgrades, 1 );
+            }
+        } else {
+            request_msg = (message) {
+                .type = WRITE_REQUEST,
+                .sender = current_thread,
+                .address = line,
+                .data = { current_instr.value }
+            };
+            sendMessage( target_proc, request_msg );
+            node->awaiting_response = 1;
+        }
+    }
+
+    if ( node->awaiting_response ) {
+        node->request_cycle = node->clock;
+        node->request_type = request_msg.type;
+#if NODE_COUNTERS
+        node_stats[ current_thread ].request_start_ns = nowNanos();
+#endif
+    }
+    countEvent( current_thread );
+    return true;
+}
+
+void printUsage( const char *program ) {
+    fprintf( stderr, "Usage: %s [--wait=spin|yield|park] [--workers[=N]] [--stats] [--report=FILE] [--procs=N] "
+                     "[--mem-size=N] [--cache-size=N] [--max-instr=N] [--binary] <test_directory>\n"
+                     "       %s [options] --topology=crossbar|ring|mesh [--hop-latency=N] "
+                     "[--link-bandwidth=N] <test_directory>\n"
+                     "       %s [options] --pin=compact|scatter|LIST <test_directory>\n"
+                     "       %s [options] --directory=full|limited|coarse|sparse [--dir-pointers=N] "
+                     "[--dir-entries=N] [--protocol=mesi|moesi] [--mshrs=N] <test_directory>\n"
+                     "       %s [options] --line-size=N [--mshrs=N --prefetch=none|next|stride] <test_directory>\n"
+                     "       %s [options] --replay[=instruction_order.txt] | --seed=N <test_directory>\n"
+                     "       %s [options] --snapshot-every=N [--snapshot-file=FILE] <test_directory>\n"
+                     "       %s [options] --replay | --seed=N --checkpoint=FILE --checkpoint-at=N <test_directory>\n"
+                     "       %s [options] --restore=FILE <test_directory>\n"
+                     "       %s [options] --workload=uniform|hotspot|producer-consumer|migratory|false-sharing|"
+                     "read-mostly [--workload-seed=N] [--write-ratio=F] [--length=N]\n"
+                     "       %s [--procs=N] [--mem-size=N] [--cache-size=N] --convert <test_directory>\n"
+                     "       %s [options] --sweep=FILE [--jobs=N] [--report=FILE] [<test_directory> ...]\n"
+                     "       %s [--pin=compact|scatter|LIST] --bench-queue\n"
+                     "       %s --bench-trace[=N]\n", program, program, program, program, program, program, program, program, program, program, program, program, program,
+             program );
+}
+
+// the index field is at least 4 bits and the node field leaves room for an
+// all-ones node id, so the default 4x16 machine keeps 0xFF as invalid
+void finalizeConfig() {
+    int node_bits = 4;
+    config.index_bits = 4;
+    while ( ( 1 << config.index_bits ) < config.mem_size ) {
+        config.index_bits++;
+    }
+    while ( ( 1 << node_bits ) <= config.num_procs ) {
+        node_bits++;
+    }
+    config.invalid_address = ( 1u << ( config.index_bits + node_bits ) ) - 1;
+    config.line_bits = 0;
+    while ( ( 1 << config.line_bits ) < config.line_size ) {
+        config.line_bits++;
+    }
+    config.mem_lines = config.mem_size >> config.line_bits;
+    config.sharer_words = ( config.num_procs + 63 ) / 64;
+    config.cache_sets = config.cache_size / config.cache_ways;
+    config.mesh_width = 1;
+    while ( config.mesh_width * config.mesh_width < config.num_procs ) {
+        config.mesh_width++;
+    }
+
+    // a limited or coarse entry is a header byte ( pointer count, DIR_OVERFLOW )
+    // followed by the pointers, or by the coarse vector once they run out
+    if ( config.directory == DIR_LIMITED || config.directory == DIR_COARSE ) {
+        config.entry_bytes = 1 + config.dir_pointers;
+    } else {
+        config.entry_bytes = config.sharer_words * sizeof( uint64_t );
+    }
+    config.coarse_group = ( config.num_procs + config.dir_pointers * 8 - 1 ) / ( config.dir_pointers * 8 );
+    if ( config.dir_entries == 0 ) {
+        config.dir_entries = config.mem_lines > 1 ? config.mem_lines / 2 : 1;
+    }
+    config.dir_ways = config.dir_entries < DIR_SPARSE_WAYS ? config.dir_entries : DIR_SPARSE_WAYS;
+    config.dir_sets = config.dir_entries / config.dir_ways;
+}
+
+int parsePositive( const char *arg, const char *name, int max_value ) {
+    char *end;
+    long value = strtol( arg, &end, 10 );
+    if ( *arg == '\0' || *end != '\0' || value < 1 || value > max_value ) {
+        fprintf( stderr, "Error: --%s must be between 1 and %d\n", name, max_value );
+        exit( EXIT_FAILURE );
+    }
+    return (int) value;
+}
+
+void *allocOrDie( size_t count, size_t size ) {
+    void *ptr = calloc( count, size );
+    if ( !ptr ) {
+        fprintf( stderr, "Error: out of memory\n" );
+        exit( EXIT_FAILURE );
+    }
+    return ptr;
+}
+
+// zeroed like allocOrDie, but starting on a cache line for the per-node records
+void *allocLinesOrDie( size_t count, size_t size ) {
+    size_t bytes = ( count * size + CACHE_LINE_SIZE - 1 ) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    void *ptr = aligned_alloc( CACHE_LINE_SIZE, bytes );
+    if ( !ptr ) {
+        fprintf( stderr, "Error: out of memory\n" );
+        exit( EXIT_FAILURE );
+    }
+    memset( ptr, 0, bytes );
+    return ptr;
+}
+
+// a Linux CPU list such as 0,2,4-7, kept in the order written. Returns the
+// number of CPUs, or -1 when the list is malformed or longer than max_count
+int parseCpuList( const char *text, int *cpus, int max_count ) {
+    int count = 0;
+    while ( true ) {
+        char *end;
+        long first = strtol( text, &end, 10 );
+        if ( end == text || first < 0 || first >= CPU_SETSIZE ) {
+            return -1;
+        }
+        long last = first;
+        if ( *end == '-' ) {
+            text = end + 1;
+            last = strtol( text, &end, 10 );
+            if ( end == text || last < first || last >= CPU_SETSIZE ) {
+                return -1;
+            }
+        }
+        for ( long cpu = first; cpu <= last; cpu++ ) {
+            if ( count == max_count ) {
+                return -1;
+            }
+            cpus[ count++ ] = cpu;
+        }
+        if ( *end != ',' ) {
+            return *end == '\0' || *end == '\n' ? count : -1;
+        }
+        text = end + 1;
+    }
+}
+
+// compact fills the CPUs of one NUMA node before moving to the next, scatter
+// deals them out round-robin across the nodes, and anything else is an
+// explicit list. Only CPUs this process may run on are used
+void buildPinList( const char *policy ) {
+    cpu_set_t allowed;
+    if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 ) {
+        fprintf( stderr, "Error: could not read the CPUs this process may use\n" );
+        exit( EXIT_FAILURE );
+    }
+    pin_cpus = allocOrDie( CPU_SETSIZE, sizeof( int ) );
+
+    if ( strcmp( policy, "compact" ) != 0 && strcmp( policy, "scatter" ) != 0 ) {
+        pin_count = parseCpuList( policy, pin_cpus, CPU_SETSIZE );
+        if ( pin_count <= 0 ) {
+            fprintf( stderr, "Error: --pin takes compact, scatter or a CPU list such as 0,2,4-7\n" );
+            exit( EXIT_FAILURE );
+        }
+        for ( int idx = 0; idx < pin_count; idx++ ) {
+            if ( !CPU_ISSET( pin_cpus[ idx ], &allowed ) ) {
+                fprintf( stderr, "Error: CPU %d is not available to this process\n", pin_cpus[ idx ] );
+                exit( EXIT_FAILURE );
+            }
+        }
+        return;
+    }
+
+    // CPUs missing from sysfs, or every CPU on a machine without it, count as
+    // the first NUMA node
+    int *numa_of = allocOrDie( CPU_SETSIZE, sizeof( int ) );
+    int *listed = allocOrDie( CPU_SETSIZE, sizeof( int ) );
+    int numa_nodes = 0;
+    for ( int numa = 0; numa < CPU_SETSIZE; numa++ ) {
+        char path[ 64 ], text[ 4096 ];
+        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", numa );
+        FILE *file = fopen( path, "r" );
+        if ( !file ) {
+            continue;
+        }
+        int count = fgets( text, sizeof( text ), file ) ? parseCpuList( text, listed, CPU_SETSIZE ) : -1;
+        fclose( file );
+        // memory-only nodes list no CPUs
+        if ( count > 0 ) {
+            for ( int idx = 0; idx < count; idx++ ) {
+                numa_of[ listed[ idx ] ] = numa_nodes;
+            }
+            numa_nodes++;
+        }
+    }
+    if ( numa_nodes == 0 ) {
+        numa_nodes = 1;
+    }
+
+    int *next_cpu = allocOrDie( numa_nodes, sizeof( int ) );
+    int available = CPU_COUNT( &allowed );
+    bool scatter = strcmp( policy, "scatter" ) == 0;
+    pin_count = 0;
+    for ( int numa = 0; pin_count < available; numa = ( numa + 1 ) % numa_nodes ) {
+        // scatter takes one CPU from each node in turn, compact drains a node first
+        do {
+            int cpu = next_cpu[ numa ];
+            while ( cpu < CPU_SETSIZE && !( CPU_ISSET( cpu, &allowed ) && numa_of[ cpu ] == numa ) ) {
+                cpu++;
+            }
+            if ( cpu == CPU_SETSIZE ) {
+                break;
+            }
+            pin_cpus[ pin_count++ ] = cpu;
+            next_cpu[ numa ] = cpu + 1;
+        } while ( !scatter );
+    }
+    free( next_cpu );
+    free( listed );
+    free( numa_of );
+}
+
+void pinThread( int index ) {
+    if ( pin_count == 0 ) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    CPU_SET( pin_cpus[ index % pin_count ], &cpus );
+    if ( sched_setaffinity( 0, sizeof( cpus ), &cpus ) != 0 ) {
+        fprintf( stderr, "Error: could not pin a thread to CPU %d\n", pin_cpus[ index % pin_count ] );
+        exit( EXIT_FAILURE );
+    }
+}
+
+int homeNode( memAddress address ) {
+    return address >> config.index_bits;
+}
+
+int memIndex( memAddress address ) {
+    return address & ( ( 1u << config.index_bits ) - 1 );
+}
+
+// lines are aligned runs of line_size blocks of one home, named by their first block
+memAddress lineAddress( memAddress address ) {
+    return address & ~( ( 1u << config.line_bits ) - 1 );
+}
+
+int lineOffset( memAddress address ) {
+    return address & ( ( 1u << config.line_bits ) - 1 );
+}
+
+void sharersClear( uint64_t *bits ) {
+    memset( bits, 0, config.sharer_words * sizeof( uint64_t ) );
+}
+
+void sharersAdd( uint64_t *bits, int node_id ) {
+    bits[ node_id / 64 ] |= 1ULL << ( node_id % 64 );
+}
+
+void sharersRemove( uint64_t *bits, int node_id ) {
+    bits[ node_id / 64 ] &= ~( 1ULL << ( node_id % 64 ) );
+}
+
+int sharersCount( const uint64_t *bits ) {
+    int count = 0;
+    for ( int word = 0; word < config.sharer_words; word++ ) {
+        count += __builtin_popcountll( bits[ word ] );
+    }
+    return count;
+}
+
+// lowest numbered sharer, -1 when the set is empty
+int sharersFirst( const uint64_t *bits ) {
+    for ( int word = 0; word < config.sharer_words; word++ ) {
+        if ( bits[ word ] ) {
+            return word * 64 + __builtin_ctzll( bits[ word ] );
+        }
+    }
+    return -1;
+}
+
+sharerSet sharersExcept( const uint64_t *bits, int node_id ) {
+    sharerSet others = { { 0 } };
+    memcpy( others.words, bits, config.sharer_words * sizeof( uint64_t ) );
+    sharersRemove( others.words, node_id );
+    return others;
+}
+
+// directory entry for the line holding the block, or -1 when a sparse
+// directory has none
+int directoryFind( processorNode *node, int mem_location ) {
+    int line = mem_location >> config.line_bits;
+    if ( config.directory != DIR_SPARSE ) {
+        return line;
+    }
+    int base = ( line % config.dir_sets ) * config.dir_ways;
+    for ( int way = 0; way < config.dir_ways; way++ ) {
+        if ( node->dir_tags[ base + way ] == line ) {
+            node->dir_stamps[ base + way ] = ++node->dir_clock;
+            return base + way;
+        }
+    }
+    return -1;
+}
+
+// directory entry for the block, allocating one in a sparse directory: a free
+// or unowned way if the set has one, otherwise the LRU entry is dropped after
+// invalidating every copy it tracks
+int directorySlot( int node_id, int mem_location, bool allocate ) {
+    processorNode *node = &nodes[ node_id ];
+    int slot = directoryFind( node, mem_location );
+    if ( slot >= 0 || !allocate ) {
+        return slot;
+    }
+
+    int line = mem_location >> config.line_bits;
+    int base = ( line % config.dir_sets ) * config.dir_ways;
+    slot = base;
+    for ( int way = 0; way < config.dir_ways; way++ ) {
+        if ( node->dir_tags[ base + way ] < 0 || node->directory[ base + way ].state == U ) {
+            slot = base + way;
+            break;
+        }
+        if ( node->dir_stamps[ base + way ] < node->dir_stamps[ slot ] ) {
+            slot = base + way;
+        }
+    }
+
+    if ( node->dir_tags[ slot ] >= 0 && node->directory[ slot ].state != U ) {
+        memAddress victim = ( (memAddress) node_id << config.index_bits ) |
+                            ( node->dir_tags[ slot ] << config.line_bits );
+        sharerSet sharers = directorySharers( node, slot );
+        for ( int word = 0; word < config.sharer_words; word++ ) {
+            for ( uint64_t bits = sharers.words[ word ]; bits; bits &= bits - 1 ) {
+                message recall_msg = {
+                    .type = INV,
+                    .sender = node_id,
+                    .address = victim,
+                    .dirState = U,      // the entry is gone, owned data must come home
+                };
+                sendMessage( word * 64 + __builtin_ctzll( bits ), recall_msg );
+                COUNT( node_id, recall_invalidations, 1 );
+            }
+        }
+        COUNT( node_id, directory_evictions, 1 );
+    }
+
+    node->dir_tags[ slot ] = line;
+    node->dir_stamps[ slot ] = ++node->dir_clock;
+    if ( node->dir_transfers ) {
+        node->dir_transfers[ slot ] = -1;
+    }
+    node->directory[ slot ].state = U;
+    directoryClear( node, slot );
+    return slot;
+}
+
+void directoryClear( processorNode *node, int slot ) {
+    memset( node->sharer_slab + (size_t) slot * config.entry_bytes, 0, config.entry_bytes );
+}
+
+// the sharer set an entry stands for, a superset of the real sharers once a
+// limited or coarse entry has overflowed
+sharerSet directorySharers( processorNode *node, int slot ) {
+    byte *field = node->sharer_slab + (size_t) slot * config.entry_bytes;
+    sharerSet sharers = { { 0 } };
+
+    if ( config.directory == DIR_FULL_MAP || config.directory == DIR_SPARSE ) {
+        memcpy( sharers.words, field, config.entry_bytes );
+    } else if ( !( field[ 0 ] & DIR_OVERFLOW ) ) {
+        for ( int pointer = 1; pointer <= field[ 0 ]; pointer++ ) {
+            sharersAdd( sharers.words, field[ pointer ] );
+        }
+    } else if ( config.directory == DIR_LIMITED ) {
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            sharersAdd( sharers.words, idx );
+        }
+    } else {
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            int group = idx / config.coarse_group;
+            if ( field[ 1 + group / 8 ] & ( 1 << ( group % 8 ) ) ) {
+                sharersAdd( sharers.words, idx );
+            }
+        }
+    }
+    return sharers;
+}
+
+sharerSet directoryExcept( processorNode *node, int slot, int node_id ) {
+    sharerSet others = directorySharers( node, slot );
+    sharersRemove( others.words, node_id );
+    return others;
+}
+
+void directoryAdd( processorNode *node, int slot, int node_id ) {
+    byte *field = node->sharer_slab + (size_t) slot * config.entry_bytes;
+
+    if ( config.directory == DIR_FULL_MAP || config.directory == DIR_SPARSE ) {
+        sharersAdd( (uint64_t *) field, node_id );
+        return;
+    }
+    if ( field[ 0 ] & DIR_OVERFLOW ) {
+        if ( config.directory == DIR_COARSE ) {
+            int group = node_id / config.coarse_group;
+            field[ 1 + group / 8 ] |= 1 << ( group % 8 );
+        }
+        return;
+    }
+    for ( int pointer = 1; pointer <= field[ 0 ]; pointer++ ) {
+        if ( field[ pointer ] == node_id ) {
+            return;
+        }
+    }
+    if ( field[ 0 ] < config.dir_pointers ) {
+        field[ ++field[ 0 ] ] = node_id;
+        return;
+    }
+
+    // out of pointers: broadcast from now on, or fold them into the coarse vector
+    byte held[ MAX_DIR_POINTERS + 1 ];
+    int count = field[ 0 ];
+    memcpy( held, field + 1, count );
+    held[ count++ ] = node_id;
+    memset( field, 0, config.entry_bytes );
+    field[ 0 ] = DIR_OVERFLOW;
+    if ( config.directory == DIR_COARSE ) {
+        for ( int pointer = 0; pointer < count; pointer++ ) {
+            int group = held[ pointer ] / config.coarse_group;
+            field[ 1 + group / 8 ] |= 1 << ( group % 8 );
+        }
+    }
+}
+
+// an overflowed entry cannot tell whether the node was the last sharer in
+// its group, so it keeps the bit until the next write clears the entry
+void directoryRemove( processorNode *node, int slot, int node_id ) {
+    byte *field = node->sharer_slab + (size_t) slot * config.entry_bytes;
+
+    if ( config.directory == DIR_FULL_MAP || config.directory == DIR_SPARSE ) {
+        sharersRemove( (uint64_t *) field, node_id );
+        return;
+    }
+    if ( field[ 0 ] & DIR_OVERFLOW ) {
+        return;
+    }
+    for ( int pointer = 1; pointer <= field[ 0 ]; pointer++ ) {
+        if ( field[ pointer ] == node_id ) {
+            field[ pointer ] = field[ field[ 0 ] ];
+            field[ 0 ]--;
+            return;
+        }
+    }
+}
+
+int directoryCount( processorNode *node, int slot ) {
+    byte *field = node->sharer_slab + (size_t) slot * config.entry_bytes;
+
+    if ( config.directory == DIR_FULL_MAP || config.directory == DIR_SPARSE ) {
+        return sharersCount( (uint64_t *) field );
+    }
+    if ( !( field[ 0 ] & DIR_OVERFLOW ) ) {
+        return field[ 0 ];
+    }
+    sharerSet sharers = directorySharers( node, slot );
+    return sharersCount( sharers.words );
+}
+
+int directoryFirst( processorNode *node, int slot ) {
+    sharerSet sharers = directorySharers( node, slot );
+    return sharersFirst( sharers.words );
+}
+
+// directory footprint of one node under an encoding: the entries, their
+// sharer fields, when sparse the tags and LRU stamps, and the MOESI owners
+size_t directoryBytes( directoryEncoding encoding ) {
+    size_t entries = encoding == DIR_SPARSE ? config.dir_entries : config.mem_lines;
+    size_t field = encoding == DIR_LIMITED || encoding == DIR_COARSE ?
+                   (size_t) ( 1 + config.dir_pointers ) : config.sharer_words * sizeof( uint64_t );
+    size_t bytes = entries * ( sizeof( directoryEntry ) + field );
+    if ( encoding == DIR_SPARSE ) {
+        bytes += entries * ( sizeof( int ) + sizeof( uint32_t ) );
+    }
+    if ( config.protocol == PROTOCOL_MOESI ) {
+        bytes += entries * sizeof( int );
+    }
+    return bytes;
+}
+
+void printDirectorySummary() {
+    long long invalidations = 0, useless = 0, evictions = 0, recalls = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        invalidations += node_stats[ idx ].invalidations_sent;
+        useless += node_stats[ idx ].useless_invalidations;
+        evictions += node_stats[ idx ].directory_evictions;
+        recalls += node_stats[ idx ].recall_invalidations;
+    }
+
+    size_t bytes = directoryBytes( config.directory );
+    size_t full_bytes = directoryBytes( DIR_FULL_MAP );
+    fprintf( stderr, "directory: %s, %zu bytes per node, full map %zu ( %.1f%% saved )\n",
+             directoryEncodingStr[ config.directory ], bytes, full_bytes,
+             100.0 * ( (double) full_bytes - bytes ) / full_bytes );
+    fprintf( stderr, "directory: %lld INVs on writes, %lld found no copy, "
+                     "%lld entries evicted with %lld INVs\n",
+             invalidations, useless, evictions, recalls );
+}
+
+// line holding the address in any state, -1 when it is not cached. Caches
+// and coherence requests always name a line by its first block
+int cacheFind( processorNode *node, memAddress address ) {
+    int base = ( ( memIndex( address ) >> config.line_bits ) % config.cache_sets ) * config.cache_ways;
+    int found = -1;
+    // no early exit, every way is compared and the match picked with a select
+    for ( int way = 0; way < config.cache_ways; way++ ) {
+        found = node->cache_tags[ base + way ] == address ? base + way : found;
+    }
+    return found;
+}
+
+// line a coherence request for the address acts on; a direct-mapped cache has
+// always used the one line the address maps to, whatever it currently holds.
+// With MSHRs that line may be another block's pending fill, so only a match counts
+int cacheLocate( processorNode *node, memAddress address ) {
+    int slot = cacheFind( node, address );
+    if ( slot < 0 && config.cache_ways == 1 && !config.mshrs ) {
+        slot = ( memIndex( address ) >> config.line_bits ) % config.cache_sets;
+    }
+    return slot;
+}
+
+// line a fill for the address goes into: the line already tagged with it, an
+// invalid way, or the victim picked by the replacement policy
+int cacheSlotFor( processorNode *node, memAddress address ) {
+    int slot = cacheFind( node, address );
+    if ( slot >= 0 ) {
+        return slot;
+    }
+
+    int base = ( ( memIndex( address ) >> config.line_bits ) % config.cache_sets ) * config.cache_ways;
+    for ( int way = 0; way < config.cache_ways; way++ ) {
+        if ( node->cache_states[ base + way ] == INVALID ) {
+            return base + way;
+        }
+    }
+
+    int victim = 0;
+    switch ( config.replacement ) {
+        case REPLACE_LRU:
+            for ( int way = 1; way < config.cache_ways; way++ ) {
+                if ( node->cache_stamps[ base + way ] < node->cache_stamps[ base + victim ] ) {
+                    victim = way;
+                }
+            }
+            break;
+        case REPLACE_PLRU: {
+            // follow the tree bits, each one points at the colder half
+            uint32_t bits = node->cache_stamps[ base ];
+            int tree_node = 0;
+            while ( tree_node < config.cache_ways - 1 ) {
+                tree_node = 2 * tree_node + 1 + ( ( bits >> tree_node ) & 1 );
+            }
+            victim = tree_node - ( config.cache_ways - 1 );
+            break;
+        }
+        case REPLACE_RANDOM:
+            victim = nextRandom( &node->random_state ) % config.cache_ways;
+            break;
+    }
+    return base + victim;
+}
+
+void cacheFill( processorNode *node, int slot, memAddress address, const byte *data, cacheLineState state ) {
+    node->cache_tags[ slot ] = address;
+    for ( int block = 0; block < config.line_size; block++ ) {
+        *cacheBlock( node, slot, block ) = data[ block ];
+    }
+    node->cache_states[ slot ] = state;
+    if ( node->cache_prefetched ) {
+        node->cache_prefetched[ slot ] = 0;
+    }
+    cacheTouch( node, slot );
+}
+
+// block b of line i is cache_values[ b * cache_size + i ], which keeps every
+// line's first block where printProcessorState reads it
+byte *cacheBlock( processorNode *node, int slot, int block ) {
+    return &node->cache_values[ (size_t) block * config.cache_size + slot ];
+}
+
+void cacheReadLine( processorNode *node, int slot, byte *data ) {
+    for ( int block = 0; block < config.line_size; block++ ) {
+        data[ block ] = *cacheBlock( node, slot, block );
+    }
+}
+
+void cacheTouch( processorNode *node, int slot ) {
+    if ( config.replacement == REPLACE_LRU ) {
+        node->cache_stamps[ slot ] = ++node->access_clock;
+    } else if ( config.replacement == REPLACE_PLRU ) {
+        // walk from the leaf to the root pointing every bit away from this way
+        int base = slot - slot % config.cache_ways;
+        uint32_t bits = node->cache_stamps[ base ];
+        int tree_node = slot - base + config.cache_ways - 1;
+        while ( tree_node > 0 ) {
+            int parent = ( tree_node - 1 ) / 2;
+            bool came_from_left = tree_node == 2 * parent + 1;
+            bits = came_from_left ? bits | ( 1u << parent ) : bits & ~( 1u << parent );
+            tree_node = parent;
+        }
+        node->cache_stamps[ base ] = bits;
+    }
+}
+
+cacheLine cacheLineAt( processorNode *node, int slot ) {
+    cacheLine line = {
+        .address = node->cache_tags[ slot ],
+        .state = node->cache_states[ slot ],
+    };
+    cacheReadLine( node, slot, line.data );
+    return line;
+}
+
+// binary, most significant node first, never narrower than the original byte
+void formatSharers( const uint64_t *bits, char *out ) {
+    int width = config.num_procs > 8 ? config.num_procs : 8;
+    for ( int bit = width - 1; bit >= 0; bit-- ) {
+        bool set = bit < config.num_procs && ( bits[ bit / 64 ] >> ( bit % 64 ) & 1 );
+        *out++ = set ? '1' : '0';
+    }
+    *out = '\0';
+}
+
+void sendMessage( int receiver, message msg ) {
+    // count it before the receiver can possibly see (and retire) it
+    #pragma omp atomic
+    pending_messages++;
+    COUNT( msg.sender, msgs_sent[ msg.type ], 1 );
+    if ( config.topology != TOPOLOGY_NONE ) {
+        msg.timestamp = networkArrival( msg.sender, receiver, nodes[ msg.sender ].clock, &msg );
+    }
+
+    // the sender owns its outbox, and msg.sender is always the calling node
+    outbox *out = &outboxes[ msg.sender ];
+    if ( out->deferred[ receiver ] > 0 ||
+         !enqueueMessage( &message_buffers[ receiver ], msg ) ) {
+        deferMessage( out, receiver, msg );
+        COUNT( msg.sender, deferred_sends, 1 );
+        COUNT_MAX( msg.sender, outbox_high_water, out->count );
+        return;
+    }
+
+    wakeNode( receiver );
+}
+
+void deferMessage( outbox *out, int receiver, message msg ) {
+    if ( out->count == out->capacity ) {
+        out->capacity = out->capacity ? out->capacity * 2 : 16;
+        out->sends = realloc( out->sends, out->capacity * sizeof( pendingSend ) );
+        if ( !out->sends ) {
+            fprintf( stderr, "Error: could not grow outbox\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    out->sends[ out->count++ ] = (pendingSend) { .receiver = receiver, .msg = msg };
+    out->deferred[ receiver ]++;
+}
+
+void flushOutbox( int node_id ) {
+    outbox *out = &outboxes[ node_id ];
+    if ( out->count == 0 ) {
+        return;
+    }
+
+    // once a receiver refuses a message, everything behind it for that
+    // receiver stays put so per-pair ordering is preserved
+    bool *blocked = out->blocked;
+    memset( blocked, 0, config.num_procs * sizeof( bool ) );
+    int kept = 0;
+    for ( int idx = 0; idx < out->count; idx++ ) {
+        pendingSend send = out->sends[ idx ];
+        if ( !blocked[ send.receiver ] &&
+             enqueueMessage( &message_buffers[ send.receiver ], send.msg ) ) {
+            out->deferred[ send.receiver ]--;
+            wakeNode( send.receiver );
+        } else {
+            blocked[ send.receiver ] = true;
+            out->sends[ kept++ ] = send;
+        }
+    }
+    out->count = kept;
+}
+
+void initMessageBuffer( messageBuffer *msg_buf ) {
+    for ( size_t idx = 0; idx < MSG_BUFFER_SIZE; idx++ ) {
+        atomic_init( &msg_buf->slots[ idx ].sequence, idx );
+    }
+    atomic_init( &msg_buf->tail, 0 );
+    msg_buf->head = 0;
+    msg_buf->high_water = 0;
+}
+
+bool enqueueMessage( messageBuffer *msg_buf, message msg ) {
+    size_t pos = atomic_load_explicit( &msg_buf->tail, memory_order_relaxed );
+    messageSlot *slot;
+
+    while ( true ) {
+        slot = &msg_buf->slots[ pos & ( MSG_BUFFER_SIZE - 1 ) ];
+        size_t sequence = atomic_load_explicit( &slot->sequence, memory_order_acquire );
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+        if ( diff == 0 ) {
+            // slot is free for this lap, try to claim it
+            if ( atomic_compare_exchange_weak_explicit( &msg_buf->tail, &pos, pos + 1,
+                                                        memory_order_relaxed,
+                                                        memory_order_relaxed ) ) {
+                break;
+            }
+        } else if ( diff < 0 ) {
+            // consumer has not freed this slot from the previous lap yet
+            return false;
+        } else {
+            pos = atomic_load_explicit( &msg_buf->tail, memory_order_relaxed );
+        }
+    }
+
+    slot->msg = msg;
+    atomic_store_explicit( &slot->sequence, pos + 1, memory_order_release );
+    return true;
+}
+
+bool dequeueMessage( messageBuffer *msg_buf, message *msg ) {
+    messageSlot *slot = &msg_buf->slots[ msg_buf->head & ( MSG_BUFFER_SIZE - 1 ) ];
+    size_t sequence = atomic_load_explicit( &slot->sequence, memory_order_acquire );
+    if ( sequence != msg_buf->head + 1 ) {
+        return false;
+    }
+
+    size_t backlog = atomic_load_explicit( &msg_buf->tail, memory_order_relaxed ) - msg_buf->head;
+    if ( backlog > msg_buf->high_water ) {
+        msg_buf->high_water = backlog;
+    }
+
+    *msg = slot->msg;
+    atomic_store_explicit( &slot->sequence, msg_buf->head + MSG_BUFFER_SIZE,
+                           memory_order_release );
+    msg_buf->head++;
+    return true;
+}
+
+// copies out every published message up to max_count, reading the producers'
+// tail once per batch rather than once per message
+int dequeueBatch( messageBuffer *msg_buf, message *batch, int max_count ) {
+    size_t head = msg_buf->head;
+    int count = 0;
+
+    while ( count < max_count ) {
+        messageSlot *slot = &msg_buf->slots[ head & ( MSG_BUFFER_SIZE - 1 ) ];
+        if ( atomic_load_explicit( &slot->sequence, memory_order_acquire ) != head + 1 ) {
+            break;
+        }
+        batch[ count++ ] = slot->msg;
+        atomic_store_explicit( &slot->sequence, head + MSG_BUFFER_SIZE, memory_order_release );
+        head++;
+    }
+    if ( count == 0 ) {
+        return 0;
+    }
+
+    size_t backlog = atomic_load_explicit( &msg_buf->tail, memory_order_relaxed ) - msg_buf->head;
+    if ( backlog > msg_buf->high_water ) {
+        msg_buf->high_water = backlog;
+    }
+    msg_buf->head = head;
+    return count;
+}
+
+bool lockedEnqueueMessage( lockedMessageBuffer *msg_buf, message msg ) {
+    bool queued = false;
+
+    omp_set_lock( &msg_buf->lock );
+    if ( msg_buf->count < MSG_BUFFER_SIZE ) {
+        msg_buf->queue[ msg_buf->tail ] = msg;
+        msg_buf->tail = ( msg_buf->tail + 1 ) % MSG_BUFFER_SIZE;
+        msg_buf->count++;
+        queued = true;
+    }
+    omp_unset_lock( &msg_buf->lock );
+
+    return queued;
+}
+
+bool lockedDequeueMessage( lockedMessageBuffer *msg_buf, message *msg ) {
+    bool dequeued = false;
+
+    omp_set_lock( &msg_buf->lock );
+    if ( msg_buf->count > 0 ) {
+        *msg = msg_buf->queue[ msg_buf->head ];
+        msg_buf->head = ( msg_buf->head + 1 ) % MSG_BUFFER_SIZE;
+        msg_buf->count--;
+        dequeued = true;
+    }
+    omp_unset_lock( &msg_buf->lock );
+
+    return dequeued;
+}
+
+void benchmarkQueues() {
+    static const int producer_counts[] = { 4, 8, 16, 64 };
+    const long total_messages = 1 << 20;
+
+    // one consumer thread drains while the producers split the message budget
+    printf( "%-10s %-10s %12s %16s %14s %14s\n", "queue", "producers", "time (ms)", "msgs/sec",
+            "cache-misses", "L1d misses" );
+    for ( int idx = 0; idx < 4; idx++ ) {
+        int producers = producer_counts[ idx ];
+        long per_producer = total_messages / producers;
+        long expected = per_producer * producers;
+
+        for ( int locked = 1; locked >= 0; locked-- ) {
+            messageBuffer *lock_free = allocLinesOrDie( 1, sizeof( messageBuffer ) );
+            lockedMessageBuffer *with_lock = allocOrDie( 1, sizeof( lockedMessageBuffer ) );
+            initMessageBuffer( lock_free );
+            with_lock->head = with_lock->tail = with_lock->count = 0;
+            omp_init_lock( &with_lock->lock );
+            long long misses[ BENCH_COUNTERS ] = { 0 };
+
+            long long start_ns = nowNanos();
+            #pragma omp parallel num_threads( producers + 1 )
+            {
+                int thread_id = omp_get_thread_num();
+                message msg = { .type = INV, .sender = thread_id };
+                int fds[ BENCH_COUNTERS ];
+                pinThread( thread_id );
+                openCacheCounters( fds );
+
+                if ( thread_id == 0 ) {
+                    for ( long received = 0; received < expected; ) {
+                        bool got = locked ? lockedDequeueMessage( with_lock, &msg )
+                                          : dequeueMessage( lock_free, &msg );
+                        if ( got ) {
+                            received++;
+                        } else {
+                            sched_yield();
+                        }
+                    }
+                } else {
+                    for ( long sent = 0; sent < per_producer; sent++ ) {
+                        while ( !( locked ? lockedEnqueueMessage( with_lock, msg )
+                                          : enqueueMessage( lock_free, msg ) ) ) {
+                            sched_yield();
+                        }
+                    }
+                }
+                closeCacheCounters( fds, misses );
+            }
+            long long elapsed_ns = nowNanos() - start_ns;
+
+            char llc[ 24 ], l1d[ 24 ];
+            formatCount( misses[ 0 ], llc );
+            formatCount( misses[ 1 ], l1d );
+            printf( "%-10s %-10d %12.2f %16.0f %14s %14s\n", locked ? "locked" : "lock-free",
+                    producers, elapsed_ns / 1e6, expected / ( elapsed_ns / 1e9 ), llc, l1d );
+
+            omp_destroy_lock( &with_lock->lock );
+            free( with_lock );
+            free( lock_free );
+        }
+    }
+}
+
+// every node sends to the next one round a ring and drains its own queue,
+// counting both and retiring what it takes like the simulator does, so the
+// lines the nodes share are only the ones the protocol has to share. A build
+// with -DNODE_PADDING=0 packs the same state for the before figures
+void benchmarkLayout() {
+    static const int node_counts[] = { 4, 16, 64 };
+    const long total_messages = 1 << 20;
+
+    printf( "\n%-10s %-10s %12s %16s %14s %14s\n", "layout", "nodes", "time (ms)", "msgs/sec",
+            "cache-misses", "L1d misses" );
+    for ( int idx = 0; idx < 3; idx++ ) {
+        int count = node_counts[ idx ];
+        long per_node = total_messages / count;
+        message_buffers = allocLinesOrDie( count, sizeof( messageBuffer ) );
+        node_stats = allocLinesOrDie( count, sizeof( nodeStats ) );
+        pending_messages = 0;
+        active_nodes = count;       // keeps retireMessages from waking anyone
+        long long misses[ BENCH_COUNTERS ] = { 0 };
+        long long start_ns = 0;
+
+        #pragma omp parallel num_threads( count )
+        {
+            int node_id = omp_get_thread_num();
+            messageBuffer *next = &message_buffers[ ( node_id + 1 ) % count ];
+            message msg = { .type = INV, .sender = node_id };
+            message incoming;
+            int fds[ BENCH_COUNTERS ];
+            pinThread( node_id );
+            initMessageBuffer( &message_buffers[ node_id ] );
+            #pragma omp barrier
+            #pragma omp single
+            start_ns = nowNanos();
+            openCacheCounters( fds );
+
+            long sent = 0, received = 0;
+            while ( sent < per_node || received < per_node ) {
+                bool progress = false;
+                if ( sent < per_node && enqueueMessage( next, msg ) ) {
+                    #pragma omp atomic
+                    pending_messages++;
+                    COUNT( node_id, msgs_sent[ INV ], 1 );
+                    sent++;
+                    progress = true;
+                }
+                if ( dequeueMessage( &message_buffers[ node_id ], &incoming ) ) {
+                    COUNT( node_id, msgs_received[ INV ], 1 );
+                    retireMessages( 1 );
+                    received++;
+                    progress = true;
+                }
+                if ( !progress && !simulationFinished() ) {
+                    sched_yield();
+                }
+            }
+            closeCacheCounters( fds, misses );
+        }
+        long long elapsed_ns = nowNanos() - start_ns;
+
+        char llc[ 24 ], l1d[ 24 ];
+        formatCount( misses[ 0 ], llc );
+        formatCount( misses[ 1 ], l1d );
+        printf( "%-10s %-10d %12.2f %16.0f %14s %14s\n", NODE_PADDING ? "padded" : "packed", count,
+                elapsed_ns / 1e6, per_node * count / ( elapsed_ns / 1e9 ), llc, l1d );
+
+        free( message_buffers );
+        free( node_stats );
+    }
+    message_buffers = NULL;
+    node_stats = NULL;
+}
+
+// the calling thread's user-space cache misses. A descriptor stays -1 where
+// the kernel or the hypervisor exposes no such event
+void openCacheCounters( int *fds ) {
+    static const uint64_t events[ BENCH_COUNTERS ][ 2 ] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                              PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    };
+    for ( int idx = 0; idx < BENCH_COUNTERS; idx++ ) {
+        struct perf_event_attr attr;
+        memset( &attr, 0, sizeof( attr ) );
+        attr.size = sizeof( attr );
+        attr.type = events[ idx ][ 0 ];
+        attr.config = events[ idx ][ 1 ];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[ idx ] = syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+    }
+}
+
+// adds the thread's counts to totals, a total turns -1 once any thread could
+// not count its event
+void closeCacheCounters( int *fds, long long *totals ) {
+    for ( int idx = 0; idx < BENCH_COUNTERS; idx++ ) {
+        uint64_t value = 0;
+        bool counted = fds[ idx ] >= 0 && read( fds[ idx ], &value, sizeof( value ) ) == sizeof( value );
+        if ( fds[ idx ] >= 0 ) {
+            close( fds[ idx ] );
+        }
+        #pragma omp critical( cache_counters )
+        totals[ idx ] = !counted || totals[ idx ] < 0 ? -1 : totals[ idx ] + (long long) value;
+    }
+}
+
+void formatCount( long long count, char *out ) {
+    if ( count < 0 ) {
+        strcpy( out, "n/a" );
+    } else {
+        sprintf( out, "%lld", count );
+    }
+}
+
+void retireMessages( int count ) {
+    int messages_left, nodes_left;
+    #pragma omp atomic capture seq_cst
+    messages_left = pending_messages -= count;
+    if ( messages_left > 0 ) {
+        return;
+    }
+
+    #pragma omp atomic read seq_cst
+    nodes_left = active_nodes;
+    if ( nodes_left == 0 ) {
+        wakeAllNodes();
+    }
+}
+
+void retireNode() {
+    int messages_left, nodes_left;
+    #pragma omp atomic capture seq_cst
+    nodes_left = --active_nodes;
+    if ( nodes_left > 0 ) {
+        return;
+    }
+
+    // active_nodes never rises again, so whichever of the two counters hits
+    // zero last is guaranteed to see the other one at zero too
+    #pragma omp atomic read seq_cst
+    messages_left = pending_messages;
+    if ( messages_left == 0 ) {
+        wakeAllNodes();
+    }
+}
+
+bool simulationFinished() {
+    int done;
+    #pragma omp atomic read seq_cst
+    done = simulation_done;
+    return done != 0;
+}
+
+// only meaningful on the consumer side, the head belongs to the node itself
+bool hasMessages( int node_id ) {
+    messageBuffer *msg_buf = &message_buffers[ node_id ];
+    messageSlot *slot = &msg_buf->slots[ msg_buf->head & ( MSG_BUFFER_SIZE - 1 ) ];
+    return atomic_load_explicit( &slot->sequence, memory_order_acquire ) == msg_buf->head + 1;
+}
+
+void waitForMessages( int node_id ) {
+#if NODE_COUNTERS
+    long long wait_start = nowNanos();
+#endif
+
+    // with sends stuck in the outbox the node has to come back and retry them
+    if ( outboxes[ node_id ].count > 0 ) {
+        sched_yield();
+        COUNT( node_id, wait_ns, nowNanos() - wait_start );
+        return;
+    }
+
+    for ( int spins = 0; wait_strategy == WAIT_SPIN || spins < SPIN_LIMIT; spins++ ) {
+        if ( hasMessages( node_id ) || simulationFinished() ) {
+            COUNT( node_id, wait_ns, nowNanos() - wait_start );
+            return;
+        }
+    }
+
+    nodeWaiter *waiter = &node_waiters[ node_id ];
+    while ( !hasMessages( node_id ) && !simulationFinished() ) {
+        if ( wait_strategy == WAIT_YIELD ) {
+            sched_yield();
+            continue;
+        }
+
+        // announce the park before the final check. The fence pairs with the
+        // one in wakeNode: either the sender sees the flag or this check sees
+        // its message, so the wakeup cannot be lost
+        pthread_mutex_lock( &waiter->mutex );
+        #pragma omp atomic write seq_cst
+        waiter->parked = 1;
+        atomic_thread_fence( memory_order_seq_cst );
+        if ( !hasMessages( node_id ) && !simulationFinished() ) {
+            COUNT( node_id, park_count, 1 );
+            pthread_cond_wait( &waiter->wakeup, &waiter->mutex );
+        }
+        #pragma omp atomic write seq_cst
+        waiter->parked = 0;
+        pthread_mutex_unlock( &waiter->mutex );
+    }
+
+    COUNT( node_id, wait_ns, nowNanos() - wait_start );
+}
+
+void wakeNode( int node_id ) {
+    nodeWaiter *waiter = &node_waiters[ node_id ];
+    int parked;
+    // the message just published must be visible before the flag is read,
+    // or both sides can miss each other ( see waitForMessages )
+    atomic_thread_fence( memory_order_seq_cst );
+    if ( num_workers ) {
+        scheduleNode( node_id, omp_get_thread_num() );
+        return;
+    }
+    #pragma omp atomic read seq_cst
+    parked = waiter->parked;
+    if ( !parked ) {
+        return;
+    }
+
+    pthread_mutex_lock( &waiter->mutex );
+    pthread_cond_signal( &waiter->wakeup );
+    pthread_mutex_unlock( &waiter->mutex );
+}
+
+void wakeAllNodes() {
+    #pragma omp atomic write seq_cst
+    simulation_done = 1;
+
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        wakeNode( idx );
+    }
+}
+
+// cycle the message reaches the receiver. The message is cut into
+// link_bandwidth byte flits, every flit takes the first free cycle on each
+// link of the route and reaches the next router hop_latency later. Each link
+// remembers its reservations by cycle modulo LINK_WINDOW, so nodes whose
+// clocks are skewed by less than that contend correctly whatever order they
+// send in; the deterministic engine also makes the result reproducible
+long long networkArrival( int sender, int receiver, long long send_cycle, const message *msg ) {
+    if ( sender == receiver ) {
+        return send_cycle;
+    }
+
+    int links[ 2 * MAX_PROCS ];
+    int hops = routeLinks( sender, receiver, links );
+    int flits = ( messageBytes( msg ) + config.link_bandwidth - 1 ) / config.link_bandwidth;
+    long long ready[ MAX_FLITS ];
+    for ( int flit = 0; flit < flits; flit++ ) {
+        ready[ flit ] = send_cycle + flit;
+    }
+
+    for ( int hop = 0; hop < hops; hop++ ) {
+        atomic_llong *slots = &link_slots[ (size_t) links[ hop ] * LINK_WINDOW ];
+        long long cycle = ready[ 0 ];
+        for ( int flit = 0; flit < flits; flit++ ) {
+            if ( cycle < ready[ flit ] ) {
+                cycle = ready[ flit ];
+            }
+            while ( true ) {
+                atomic_llong *slot = &slots[ cycle % LINK_WINDOW ];
+                long long owner = atomic_load_explicit( slot, memory_order_relaxed );
+                if ( owner != cycle &&
+                     atomic_compare_exchange_strong_explicit( slot, &owner, cycle,
+                                                              memory_order_relaxed, memory_order_relaxed ) ) {
+                    break;
+                }
+                if ( owner != cycle ) {
+                    continue;
+                }
+                cycle++;
+            }
+            ready[ flit ] = cycle + config.hop_latency;
+            cycle++;
+        }
+    }
+    return ready[ flits - 1 ];
+}
+
+// fills links with the outgoing link ids ( router * LINK_PORTS + port ) on the
+// route and returns the hop count
+int routeLinks( int sender, int receiver, int *links ) {
+    int hops = 0;
+
+    switch ( config.topology ) {
+        case TOPOLOGY_NONE:
+            break;
+
+        case TOPOLOGY_CROSSBAR:
+            // injection link into the switch, then the switch's port to the receiver
+            links[ hops++ ] = sender * LINK_PORTS;
+            links[ hops++ ] = receiver * LINK_PORTS + 1;
+            break;
+
+        case TOPOLOGY_RING: {
+            // bidirectional, shortest direction, port 0 clockwise and port 1 back
+            int forward = ( receiver - sender + config.num_procs ) % config.num_procs;
+            int step = forward <= config.num_procs - forward ? 1 : config.num_procs - 1;
+            int port = step == 1 ? 0 : 1;
+            for ( int at = sender; at != receiver; at = ( at + step ) % config.num_procs ) {
+                links[ hops++ ] = at * LINK_PORTS + port;
+            }
+            break;
+        }
+
+        case TOPOLOGY_MESH: {
+            // dimension ordered XY routing, routers without a node still forward
+            int x = sender % config.mesh_width, y = sender / config.mesh_width;
+            int to_x = receiver % config.mesh_width, to_y = receiver / config.mesh_width;
+            while ( x != to_x ) {
+                links[ hops++ ] = ( y * config.mesh_width + x ) * LINK_PORTS + ( x < to_x ? 0 : 1 );
+                x += x < to_x ? 1 : -1;
+            }
+            while ( y != to_y ) {
+                links[ hops++ ] = ( y * config.mesh_width + x ) * LINK_PORTS + ( y < to_y ? 2 : 3 );
+                y += y < to_y ? 1 : -1;
+            }
+            break;
+        }
+    }
+    return hops;
+}
+
+int messageBytes( const message *msg ) {
+    // a write rewrites a single-block line whole, wider ones also need the
+    // rest of the line with the grant
+    int rest = config.line_size > 1 ? config.line_size * WORD_BYTES : 0;
+    switch ( msg->type ) {
+        case REPLY_RD:
+        case FLUSH:
+        case FLUSH_INVACK:
+        case EVICT_MODIFIED:
+            return MSG_HEADER_BYTES + config.line_size * WORD_BYTES;
+        case WRITE_REQUEST:
+            return MSG_HEADER_BYTES + WORD_BYTES;
+        case REPLY_WR:
+            return MSG_HEADER_BYTES + rest;
+        case REPLY_ID:
+            return MSG_HEADER_BYTES + config.sharer_words * 8 + rest;
+        default:
+            return MSG_HEADER_BYTES;
+    }
+}
+
+void recordMissLatency( int node_id, transactionType request, long long request_cycle, transactionType reply ) {
+    latencyLog *log = &latency_logs[ node_id ];
+    if ( log->count == log->capacity ) {
+        log->capacity = log->capacity ? 2 * log->capacity : 1024;
+        log->samples = realloc( log->samples, log->capacity * sizeof( latencySample ) );
+        if ( !log->samples ) {
+            fprintf( stderr, "Error: out of memory\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+    log->samples[ log->count++ ] = (latencySample) {
+        .request = request,
+        .reply = reply,
+        .cycles = (uint32_t) ( nodes[ node_id ].clock - request_cycle ),
+    };
+}
+
+static int compareSamples( const void *a, const void *b ) {
+    const latencySample *left = a, *right = b;
+    if ( left->request != right->request ) {
+        return left->request - right->request;
+    }
+    if ( left->reply != right->reply ) {
+        return left->reply - right->reply;
+    }
+    return ( left->cycles > right->cycles ) - ( left->cycles < right->cycles );
+}
+
+// merges every node's samples and summarizes each request -> reply pair,
+// the caller frees *summaries
+int summarizeLatencies( latencySummary **summaries ) {
+    long long total = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        total += latency_logs[ idx ].count;
+    }
+
+    latencySample *all = allocOrDie( total ? total : 1, sizeof( latencySample ) );
+    long long filled = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        memcpy( all + filled, latency_logs[ idx ].samples, latency_logs[ idx ].count * sizeof( latencySample ) );
+        filled += latency_logs[ idx ].count;
+    }
+    qsort( all, total, sizeof( latencySample ), compareSamples );
+
+    *summaries = allocOrDie( NUM_TRANSACTION_TYPES * NUM_TRANSACTION_TYPES, sizeof( latencySummary ) );
+    int count = 0;
+    for ( long long first = 0, last; first < total; first = last ) {
+        double sum = 0;
+        for ( last = first; last < total && all[ last ].request == all[ first ].request &&
+                                            all[ last ].reply == all[ first ].reply; last++ ) {
+            sum += all[ last ].cycles;
+        }
+        long long samples = last - first;
+        ( *summaries )[ count++ ] = (latencySummary) {
+            .request = all[ first ].request,
+            .reply = all[ first ].reply,
+            .count = (int) samples,
+            .average = sum / samples,
+            .p50 = all[ first + samples / 2 ].cycles,
+            .p99 = all[ first + ( samples * 99 ) / 100 ].cycles,
+            .max = all[ last - 1 ].cycles,
+        };
+    }
+    free( all );
+    return count;
+}
+
+void printLatencySummary() {
+    static const char *topologyStr[] = { "none", "crossbar", "ring", "mesh" };
+    latencySummary *summaries;
+    int count = summarizeLatencies( &summaries );
+
+    long long finish = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        finish = nodes[ idx ].clock > finish ? nodes[ idx ].clock : finish;
+    }
+    fprintf( stderr, "network: %s, %d cycles per hop, %d bytes per cycle, last node done at cycle %lld\n",
+             topologyStr[ config.topology ], config.hop_latency, config.link_bandwidth, finish );
+    for ( int idx = 0; idx < count; idx++ ) {
+        fprintf( stderr, "%-13s -> %-13s %8d misses, avg %8.1f, p50 %6u, p99 %6u, max %6u cycles\n",
+                 transactionTypeStr[ summaries[ idx ].request ], transactionTypeStr[ summaries[ idx ].reply ],
+                 summaries[ idx ].count, summaries[ idx ].average, summaries[ idx ].p50,
+                 summaries[ idx ].p99, summaries[ idx ].max );
+    }
+    free( summaries );
+}
+
+long long nowNanos() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void printNodeStats() {
+    static const char *strategyStr[] = { "spin", "yield", "park" };
+
+    long long instructions = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        instructions += node_stats[ idx ].reads + node_stats[ idx ].writes;
+    }
+    if ( num_workers ) {
+        fprintf( stderr, "engine: %d workers for %d nodes\n", num_workers, config.num_procs );
+    } else {
+        fprintf( stderr, "engine: one thread per node, wait strategy: %s\n", strategyStr[ wait_strategy ] );
+    }
+    fprintf( stderr, "%lld instructions in %.3f ms, %.2f M instructions/s\n",
+             instructions, run_ns / 1e6, instructions / ( run_ns / 1e3 ) );
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        long long busy_ns = node_stats[ idx ].total_ns - node_stats[ idx ].wait_ns;
+        fprintf( stderr, "Processor %d: busy %.3f ms, waiting %.3f ms, parked %lld times\n",
+                 idx, busy_ns / 1e6, node_stats[ idx ].wait_ns / 1e6,
+                 node_stats[ idx ].park_count );
+        fprintf( stderr, "Processor %d: queue high water %zu/%d, deferred sends %lld, outbox high water %d\n",
+                 idx, message_buffers[ idx ].high_water, MSG_BUFFER_SIZE,
+                 node_stats[ idx ].deferred_sends, node_stats[ idx ].outbox_high_water );
+        fprintf( stderr, "Processor %d: cache hits %lld, misses %lld, evictions %lld\n",
+                 idx, node_stats[ idx ].cache_hits, node_stats[ idx ].cache_misses,
+                 node_stats[ idx ].cache_evictions );
+        fprintf( stderr, "Processor %d: drained %lld messages in %lld batches, coalesced %lld INV, %lld EVICT_SHARED\n",
+                 idx, node_stats[ idx ].drained_messages, node_stats[ idx ].drain_batches,
+                 node_stats[ idx ].coalesced_invalidations, node_stats[ idx ].coalesced_evictions );
+    }
+
+    long long batches = 0, drained = 0, coalesced = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        batches += node_stats[ idx ].drain_batches;
+        drained += node_stats[ idx ].drained_messages;
+        coalesced += node_stats[ idx ].coalesced_invalidations + node_stats[ idx ].coalesced_evictions;
+    }
+    fprintf( stderr, "drain: %.2f messages per batch, %lld of %lld messages coalesced (%.2f%%)\n",
+             batches ? (double) drained / batches : 0.0, coalesced, drained,
+             drained ? 100.0 * coalesced / drained : 0.0 );
+
+    long long messages = 0, writebacks = 0;
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+            messages += node_stats[ idx ].msgs_sent[ type ];
+        }
+        writebacks += node_stats[ idx ].memory_writebacks;
+    }
+    fprintf( stderr, "protocol: %s, %lld messages, %lld memory writebacks\n",
+             protocolStr[ config.protocol ], messages, writebacks );
+
+    if ( config.mshrs ) {
+        long long merged = 0, stalls = 0, held = 0;
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            merged += node_stats[ idx ].merged_misses;
+            stalls += node_stats[ idx ].mshr_stalls;
+            held += node_stats[ idx ].held_messages;
+        }
+        fprintf( stderr, "mshrs: %d per node, %lld merged misses, %lld stalls on a full file, %lld requests held\n",
+                 config.mshrs, merged, stalls, held );
+    }
+
+    if ( config.prefetch != PREFETCH_NONE ) {
+        long long prefetches = 0, useful = 0;
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            prefetches += node_stats[ idx ].prefetches;
+            useful += node_stats[ idx ].useful_prefetches;
+        }
+        fprintf( stderr, "prefetch: %s on %d-block lines, %lld lines prefetched, %lld used (%.2f%%)\n",
+                 prefetchPolicyStr[ config.prefetch ], config.line_size, prefetches, useful,
+                 prefetches ? 100.0 * useful / prefetches : 0.0 );
+    }
+}
+
+// per-node counters as JSON, or as CSV with one row per node when the file
+// name ends in .csv
+void writeReport( const char *filename, const char *engine ) {
+    FILE *report = strcmp( filename, "-" ) == 0 ? stdout : fopen( filename, "w" );
+    if ( !report ) {
+        fprintf( stderr, "Error: could not open %s\n", filename );
+        exit( EXIT_FAILURE );
+    }
+    size_t name_len = strlen( filename );
+    bool csv = name_len > 4 && strcmp( filename + name_len - 4, ".csv" ) == 0;
+
+    if ( csv ) {
+        fprintf( report, "node,reads,writes,hits,misses,upgrades,evictions,invalidations_sent,"
+                         "useless_invalidations,directory_evictions,recall_invalidations,"
+                         "drain_batches,drained_messages,coalesced_invalidations,coalesced_evictions,"
+                         "memory_writebacks,merged_misses,mshr_stalls,held_messages,prefetches,useful_prefetches,"
+                         "response_ns,wait_ns,total_ns" );
+        for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+            fprintf( report, ",sent_%s", transactionTypeStr[ type ] );
+        }
+        for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+            fprintf( report, ",received_%s", transactionTypeStr[ type ] );
+        }
+        fprintf( report, "\n" );
+
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            nodeStats *stats = &node_stats[ idx ];
+            fprintf( report, "%d,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,"
+                             "%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld", idx,
+                     stats->reads, stats->writes, stats->cache_hits, stats->cache_misses,
+                     stats->upgrades, stats->cache_evictions, stats->invalidations_sent,
+                     stats->useless_invalidations, stats->directory_evictions,
+                     stats->recall_invalidations, stats->drain_batches, stats->drained_messages,
+                     stats->coalesced_invalidations, stats->coalesced_evictions,
+                     stats->memory_writebacks, stats->merged_misses, stats->mshr_stalls,
+                     stats->held_messages, stats->prefetches, stats->useful_prefetches,
+                     stats->response_ns, stats->wait_ns, stats->total_ns );
+            for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+                fprintf( report, ",%lld", stats->msgs_sent[ type ] );
+            }
+            for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+                fprintf( report, ",%lld", stats->msgs_received[ type ] );
+            }
+            fprintf( report, "\n" );
+        }
+    } else {
+        struct rusage usage;
+        getrusage( RUSAGE_SELF, &usage );
+        fprintf( report, "{\n  \"run\": { \"engine\": \"%s\", \"wall_ns\": %lld, \"peak_rss_kb\": %ld },\n",
+                 engine, run_ns, usage.ru_maxrss );
+        fprintf( report, "  \"config\": { \"procs\": %d, \"mem_size\": %d, \"cache_size\": %d, "
+                         "\"cache_ways\": %d, \"line_size\": %d, \"mshrs\": %d, \"prefetch\": \"%s\", \"counters\": %s, \"padding\": %s, \"pin\": \"%s\", \"protocol\": \"%s\", \"directory\": \"%s\", "
+                         "\"directory_bytes\": %zu, \"full_map_bytes\": %zu },\n  \"nodes\": [\n",
+                 config.num_procs, config.mem_size, config.cache_size, config.cache_ways, config.line_size,
+                 config.mshrs, prefetchPolicyStr[ config.prefetch ], NODE_COUNTERS ? "true" : "false", NODE_PADDING ? "true" : "false",
+                 pin_policy ? pin_policy : "none", protocolStr[ config.protocol ],
+                 directoryEncodingStr[ config.directory ],
+                 directoryBytes( config.directory ), directoryBytes( DIR_FULL_MAP ) );
+
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            nodeStats *stats = &node_stats[ idx ];
+            fprintf( report, "    { \"node\": %d, \"reads\": %lld, \"writes\": %lld, \"hits\": %lld, "
+                             "\"misses\": %lld, \"upgrades\": %lld, \"evictions\": %lld, "
+                             "\"invalidations_sent\": %lld, \"useless_invalidations\": %lld, "
+                             "\"directory_evictions\": %lld, \"recall_invalidations\": %lld, "
+                             "\"drain_batches\": %lld, \"drained_messages\": %lld, "
+                             "\"coalesced_invalidations\": %lld, \"coalesced_evictions\": %lld, "
+                             "\"memory_writebacks\": %lld, \"merged_misses\": %lld, \"mshr_stalls\": %lld, "
+                             "\"held_messages\": %lld, \"prefetches\": %lld, \"useful_prefetches\": %lld, "
+                             "\"response_ns\": %lld, \"wait_ns\": %lld, \"total_ns\": %lld,\n", idx,
+                     stats->reads, stats->writes, stats->cache_hits, stats->cache_misses,
+                     stats->upgrades, stats->cache_evictions, stats->invalidations_sent,
+                     stats->useless_invalidations, stats->directory_evictions,
+                     stats->recall_invalidations, stats->drain_batches, stats->drained_messages,
+                     stats->coalesced_invalidations, stats->coalesced_evictions,
+                     stats->memory_writebacks, stats->merged_misses, stats->mshr_stalls,
+                     stats->held_messages, stats->prefetches, stats->useful_prefetches,
+                     stats->response_ns, stats->wait_ns, stats->total_ns );
+
+            for ( int direction = 0; direction < 2; direction++ ) {
+                long long *counts = direction == 0 ? stats->msgs_sent : stats->msgs_received;
+                fprintf( report, "      \"%s\": {", direction == 0 ? "sent" : "received" );
+                for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+                    fprintf( report, "%s \"%s\": %lld", type ? "," : "",
+                             transactionTypeStr[ type ], counts[ type ] );
+                }
+                fprintf( report, " }%s\n", direction == 0 ? "," : "" );
+            }
+            fprintf( report, "    }%s\n", idx + 1 < config.num_procs ? "," : "" );
+        }
+        fprintf( report, "  ]" );
+
+        if ( config.topology != TOPOLOGY_NONE ) {
+            latencySummary *summaries;
+            int count = summarizeLatencies( &summaries );
+            fprintf( report, ",\n  \"miss_latency\": [\n" );
+            for ( int idx = 0; idx < count; idx++ ) {
+                fprintf( report, "    { \"request\": \"%s\", \"reply\": \"%s\", \"count\": %d, "
+                                 "\"avg\": %.2f, \"p50\": %u, \"p99\": %u, \"max\": %u }%s\n",
+                         transactionTypeStr[ summaries[ idx ].request ],
+                         transactionTypeStr[ summaries[ idx ].reply ], summaries[ idx ].count,
+                         summaries[ idx ].average, summaries[ idx ].p50, summaries[ idx ].p99,
+                         summaries[ idx ].max, idx + 1 < count ? "," : "" );
+            }
+            fprintf( report, "  ]" );
+            free( summaries );
+        }
+        fprintf( report, "\n}\n" );
+    }
+
+    if ( report != stdout ) {
+        fclose( report );
+    }
+}
+
+void countEvent( int node_id ) {
+    nodes[ node_id ].events++;
+    if ( snapshot_interval && nodes[ node_id ].events % snapshot_interval == 0 ) {
+        takeSnapshot( node_id, false );
+    }
+}
+
+// the node only pays for the copy; formatting and file I/O happen on the
+// writer thread. Blocks while SNAPSHOT_QUEUE_LIMIT snapshots are waiting
+void takeSnapshot( int node_id, bool final ) {
+    processorNode *node = &nodes[ node_id ];
+    int dir_entries = config.directory == DIR_SPARSE ? config.dir_entries : config.mem_lines;
+    bool sparse = config.directory == DIR_SPARSE;
+
+    // 4 byte arrays first, so everything after the struct stays aligned
+    size_t words = config.cache_size * ( sizeof( memAddress ) + sizeof( cacheLineState ) ) +
+                   dir_entries * ( sizeof( directoryEntry ) + ( sparse ? sizeof( int ) + sizeof( uint32_t ) : 0 ) );
+    size_t line_bytes = (size_t) config.cache_size * config.line_size;
+    size_t bytes = config.mem_size + line_bytes + (size_t) dir_entries * config.entry_bytes;
+    nodeSnapshot *snapshot = allocLinesOrDie( 1, sizeof( nodeSnapshot ) + words + bytes );
+    char *cursor = (char *) ( snapshot + 1 );
+
+    snapshot->node_id = node_id;
+    snapshot->event = node->events;
+    snapshot->final = final;
+    snapshot->next = NULL;
+    snapshot->state = *node;
+
+    processorNode *state = &snapshot->state;
+    state->dir_owners = NULL;   // not part of the output
+    state->dir_transfers = NULL;
+    state->mshrs = NULL;
+    state->held = NULL;
+    state->cache_tags = memcpy( cursor, node->cache_tags, config.cache_size * sizeof( memAddress ) );
+    cursor += config.cache_size * sizeof( memAddress );
+    state->cache_states = memcpy( cursor, node->cache_states, config.cache_size * sizeof( cacheLineState ) );
+    cursor += config.cache_size * sizeof( cacheLineState );
+    state->directory = memcpy( cursor, node->directory, dir_entries * sizeof( directoryEntry ) );
+    cursor += dir_entries * sizeof( directoryEntry );
+    if ( sparse ) {
+        state->dir_tags = memcpy( cursor, node->dir_tags, dir_entries * sizeof( int ) );
+        cursor += dir_entries * sizeof( int );
+        state->dir_stamps = memcpy( cursor, node->dir_stamps, dir_entries * sizeof( uint32_t ) );
+        cursor += dir_entries * sizeof( uint32_t );
+    }
+    state->memory = memcpy( cursor, node->memory, config.mem_size );
+    cursor += config.mem_size;
+    state->cache_values = memcpy( cursor, node->cache_values, line_bytes );
+    cursor += line_bytes;
+    state->sharer_slab = memcpy( cursor, node->sharer_slab, (size_t) dir_entries * config.entry_bytes );
+    state->cache_stamps = NULL;
+    state->cache_prefetched = NULL;
+
+    snapshotWriter *writer = &snapshot_writer;
+    pthread_mutex_lock( &writer->mutex );
+    while ( writer->queued >= SNAPSHOT_QUEUE_LIMIT ) {
+        pthread_cond_wait( &writer->room, &writer->mutex );
+    }
+    if ( writer->tail ) {
+        writer->tail->next = snapshot;
+    } else {
+        writer->head = snapshot;
+    }
+    writer->tail = snapshot;
+    writer->queued++;
+    pthread_cond_signal( &writer->ready );
+    pthread_mutex_unlock( &writer->mutex );
+}
+
+// filename is the periodic snapshot file, NULL when only the final
+// core_N_output.txt files are wanted
+void startSnapshotWriter( const char *filename ) {
+    snapshotWriter *writer = &snapshot_writer;
+    pthread_mutex_init( &writer->mutex, NULL );
+    pthread_cond_init( &writer->ready, NULL );
+    pthread_cond_init( &writer->room, NULL );
+    writer->head = writer->tail = NULL;
+    writer->queued = 0;
+    writer->stopping = false;
+    writer->file = NULL;
+    writer->images = NULL;
+    writer->records = writer->bytes = 0;
+
+    if ( filename ) {
+        writer->file = fopen( filename, "wb" );
+        if ( !writer->file ) {
+            fprintf( stderr, "Error: could not open %s\n", filename );
+            exit( EXIT_FAILURE );
+        }
+        snapshotHeader header = {
+            .magic = SNAPSHOT_MAGIC,
+            .version = SNAPSHOT_VERSION,
+            .sharer_words = config.sharer_words,
+            .num_procs = config.num_procs,
+            .mem_size = config.mem_size,
+            .cache_size = config.cache_size,
+            .line_size = config.line_size,
+        };
+        fwrite( &header, sizeof( header ), 1, writer->file );
+        writer->bytes = sizeof( header );
+        writer->images = allocOrDie( config.num_procs, sizeof( snapshotImage ) );
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            snapshotImage *image = &writer->images[ idx ];
+            image->written = false;
+            image->memory = allocOrDie( config.mem_size, sizeof( byte ) );
+            image->dir_states = allocOrDie( config.mem_size, sizeof( byte ) );
+            image->dir_sharers = allocOrDie( (size_t) config.mem_size * config.sharer_words, sizeof( uint64_t ) );
+            image->cache_tags = allocOrDie( config.cache_size, sizeof( memAddress ) );
+            image->cache_values = allocOrDie( (size_t) config.cache_size * config.line_size, sizeof( byte ) );
+            image->cache_states = allocOrDie( config.cache_size, sizeof( byte ) );
+        }
+    }
+
+    if ( pthread_create( &writer->thread, NULL, runSnapshotWriter, writer ) != 0 ) {
+        fprintf( stderr, "Error: could not start the snapshot writer\n" );
+        exit( EXIT_FAILURE );
+    }
+}
+
+// waits for every queued snapshot to be written
+void stopSnapshotWriter() {
+    snapshotWriter *writer = &snapshot_writer;
+    pthread_mutex_lock( &writer->mutex );
+    writer->stopping = true;
+    pthread_cond_signal( &writer->ready );
+    pthread_mutex_unlock( &writer->mutex );
+    pthread_join( writer->thread, NULL );
+
+    if ( writer->file ) {
+        fclose( writer->file );
+        fprintf( stderr, "snapshots: %lld records, %lld bytes\n", writer->records, writer->bytes );
+        for ( int idx = 0; idx < config.num_procs; idx++ ) {
+            snapshotImage *image = &writer->images[ idx ];
+            free( image->memory );
+            free( image->dir_states );
+            free( image->dir_sharers );
+            free( image->cache_tags );
+            free( image->cache_values );
+            free( image->cache_states );
+        }
+        free( writer->images );
+    }
+    pthread_mutex_destroy( &writer->mutex );
+    pthread_cond_destroy( &writer->ready );
+    pthread_cond_destroy( &writer->room );
+}
+
+void *runSnapshotWriter( void *arg ) {
+    snapshotWriter *writer = arg;
+
+    while ( true ) {
+        pthread_mutex_lock( &writer->mutex );
+        while ( !writer->head && !writer->stopping ) {
+            pthread_cond_wait( &writer->ready, &writer->mutex );
+        }
+        nodeSnapshot *batch = writer->head;
+        writer->head = writer->tail = NULL;
+        writer->queued = 0;
+        pthread_cond_broadcast( &writer->room );
+        pthread_mutex_unlock( &writer->mutex );
+
+        if ( !batch ) {
+            return NULL;
+        }
+        while ( batch ) {
+            nodeSnapshot *next = batch->next;
+            if ( writer->file ) {
+                writeSnapshotRecord( batch );
+            }
+            if ( batch->final ) {
+                printProcessorState( batch->node_id, &batch->state );
+            }
+            free( batch );
+            batch = next;
+        }
+    }
+}
+
+// appends the blocks, entries and lines that changed since the node's
+// previous record, everything for its first one
+void writeSnapshotRecord( nodeSnapshot *snapshot ) {
+    snapshotWriter *writer = &snapshot_writer;
+    snapshotImage *image = &writer->images[ snapshot->node_id ];
+    processorNode *state = &snapshot->state;
+    int words = config.sharer_words;
+
+    uint32_t *mem_indices = allocOrDie( config.mem_size, sizeof( uint32_t ) );
+    byte *mem_values = allocOrDie( config.mem_size, sizeof( byte ) );
+    uint32_t *dir_indices = allocOrDie( config.mem_size, sizeof( uint32_t ) );
+    byte *dir_states = allocOrDie( config.mem_size, sizeof( byte ) );
+    uint64_t *dir_sharers = allocOrDie( (size_t) config.mem_size * words, sizeof( uint64_t ) );
+    uint32_t *line_indices = allocOrDie( config.cache_size, sizeof( uint32_t ) );
+    uint32_t *line_tags = allocOrDie( config.cache_size, sizeof( uint32_t ) );
+    byte *line_values = allocOrDie( (size_t) config.cache_size * config.line_size, sizeof( byte ) );
+    byte *line_states = allocOrDie( config.cache_size, sizeof( byte ) );
+    int memory_changes = 0, directory_changes = 0, cache_changes = 0;
+
+    for ( int idx = 0; idx < config.mem_size; idx++ ) {
+        if ( !image->written || image->memory[ idx ] != state->memory[ idx ] ) {
+            image->memory[ idx ] = state->memory[ idx ];
+            mem_indices[ memory_changes ] = idx;
+            mem_values[ memory_changes++ ] = state->memory[ idx ];
+        }
+    }
+
+    // compared per block, so sparse entries moving between slots do not count
+    for ( int idx = 0; idx < config.mem_size; idx++ ) {
+        int slot = directoryFind( state, idx );
+        sharerSet current = { { 0 } };
+        byte dir_state = U;
+        if ( slot >= 0 ) {
+            current = directorySharers( state, slot );
+            dir_state = state->directory[ slot ].state;
+        }
+        uint64_t *previous = &image->dir_sharers[ (size_t) idx * words ];
+        if ( !image->written || image->dir_states[ idx ] != dir_state ||
+             memcmp( previous, current.words, words * sizeof( uint64_t ) ) != 0 ) {
+            memcpy( previous, current.words, words * sizeof( uint64_t ) );
+            image->dir_states[ idx ] = dir_state;
+            dir_indices[ directory_changes ] = idx;
+            dir_states[ directory_changes ] = dir_state;
+            memcpy( &dir_sharers[ (size_t) directory_changes * words ], current.words,
+                    words * sizeof( uint64_t ) );
+            directory_changes++;
+        }
+    }
+
+    // the image keeps each line's blocks together, the cache keeps them block-major
+    int line_size = config.line_size;
+    for ( int idx = 0; idx < config.cache_size; idx++ ) {
+        byte *previous = &image->cache_values[ (size_t) idx * line_size ];
+        bool changed = !image->written || image->cache_tags[ idx ] != state->cache_tags[ idx ] ||
+                       image->cache_states[ idx ] != state->cache_states[ idx ];
+        for ( int block = 0; block < line_size; block++ ) {
+            if ( previous[ block ] != *cacheBlock( state, idx, block ) ) {
+                changed = true;
+                previous[ block ] = *cacheBlock( state, idx, block );
+            }
+        }
+        if ( changed ) {
+            image->cache_tags[ idx ] = state->cache_tags[ idx ];
+            image->cache_states[ idx ] = state->cache_states[ idx ];
+            line_indices[ cache_changes ] = idx;
+            line_tags[ cache_changes ] = state->cache_tags[ idx ];
+            memcpy( &line_values[ (size_t) cache_changes * line_size ], previous, line_size );
+            line_states[ cache_changes++ ] = state->cache_states[ idx ];
+        }
+    }
+    image->written = true;
+
+    snapshotRecord record = {
+        .node_id = snapshot->node_id,
+        .final = snapshot->final,
+        .event = snapshot->event,
+        .memory_changes = memory_changes,
+        .directory_changes = directory_changes,
+        .cache_changes = cache_changes,
+    };
+    fwrite( &record, sizeof( record ), 1, writer->file );
+    fwrite( mem_indices, sizeof( uint32_t ), memory_changes, writer->file );
+    fwrite( mem_values, sizeof( byte ), memory_changes, writer->file );
+    fwrite( dir_indices, sizeof( uint32_t ), directory_changes, writer->file );
+    fwrite( dir_states, sizeof( byte ), directory_changes, writer->file );
+    fwrite( dir_sharers, sizeof( uint64_t ), (size_t) directory_changes * words, writer->file );
+    fwrite( line_indices, sizeof( uint32_t ), cache_changes, writer->file );
+    fwrite( line_tags, sizeof( uint32_t ), cache_changes, writer->file );
+    fwrite( line_values, sizeof( byte ), (size_t) cache_changes * line_size, writer->file );
+    fwrite( line_states, sizeof( byte ), cache_changes, writer->file );
+
+    writer->records++;
+    writer->bytes += sizeof( record ) + memory_changes * ( sizeof( uint32_t ) + 1 ) +
+                     directory_changes * ( sizeof( uint32_t ) + 1 + words * sizeof( uint64_t ) ) +
+                     cache_changes * ( 2 * sizeof( uint32_t ) + 1 + line_size );
+
+    free( mem_indices );
+    free( mem_values );
+    free( dir_indices );
+    free( dir_states );
+    free( dir_sharers );
+    free( line_indices );
+    free( line_tags );
+    free( line_values );
+    free( line_states );
+}
+
+// everything a run needs to carry on from here: each node's state and trace
+// position, then the messages in its ring and its outbox. Directories are
+// stored per memory line and caches per cache line, so a restore can rebuild
+// them for another encoding or cache shape
+void writeCheckpoint( const char *filename, const char *input_dir, long long issued,
+                      bool seeded, unsigned int seed, unsigned int random_state ) {
+    FILE *file = fopen( filename, "wb" );
+    if ( !file ) {
+        fprintf( stderr, "Error: could not open %s\n", filename );
+        exit( EXIT_FAILURE );
+    }
+
+    checkpointHeader header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .binary_traces = binary_traces,
+        .num_procs = config.num_procs,
+        .mem_size = config.mem_size,
+        .cache_size = config.cache_size,
+        .cache_ways = config.cache_ways,
+        .replacement = config.replacement,
+        .directory = config.directory,
+        .dir_entries = config.directory == DIR_SPARSE ? config.dir_entries : config.mem_lines,
+        .sharer_words = config.sharer_words,
+        .seeded = seeded,
+        .seed = seed,
+        .random_state = random_state,
+        .protocol = config.protocol,
+        .mshrs = config.mshrs,
+        .line_size = config.line_size,
+        .issued = issued,
+    };
+    snprintf( header.input_dir, sizeof( header.input_dir ), "%s", input_dir );
+    fwrite( &header, sizeof( header ), 1, file );
+
+    int words = config.sharer_words;
+    int dir_lines = config.mem_lines;
+    byte *present = allocOrDie( dir_lines, sizeof( byte ) );
+    byte *dir_states = allocOrDie( dir_lines, sizeof( byte ) );
+    int32_t *dir_owners = allocOrDie( dir_lines, sizeof( int32_t ) );
+    int32_t *dir_transfers = allocOrDie( dir_lines, sizeof( int32_t ) );
+    uint32_t *dir_slots = allocOrDie( dir_lines, sizeof( uint32_t ) );
+    uint32_t *dir_stamps = allocOrDie( dir_lines, sizeof( uint32_t ) );
+    uint64_t *dir_sharers = allocOrDie( (size_t) dir_lines * words, sizeof( uint64_t ) );
+    byte *line_states = allocOrDie( config.cache_size, sizeof( byte ) );
+
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        processorNode *node = &nodes[ idx ];
+        messageBuffer *msg_buf = &message_buffers[ idx ];
+        size_t tail = atomic_load( &msg_buf->tail );
+        checkpointNode saved = {
+            .trace_offset = node->trace.offset,
+            .trace_decoded = node->trace.decoded,
+            .current_instr = node->current_instr,
+            .awaiting_response = node->awaiting_response,
+            .done = node->done,
+            .has_next = node->has_next,
+            .request_type = node->request_type,
+            .access_clock = node->access_clock,
+            .random_state = node->random_state,
+            .dir_clock = node->dir_clock,
+            .clock = node->clock,
+            .request_cycle = node->request_cycle,
+            .events = node->events,
+            .ring_count = tail - msg_buf->head,
+            .outbox_count = outboxes[ idx ].count,
+            .next_instr = node->next_instr,
+            .mshr_count = node->outstanding,
+            .held_count = node->held_count,
+            .last_miss = node->last_miss,
+            .miss_stride = node->miss_stride,
+        };
+        fwrite( &saved, sizeof( saved ), 1, file );
+        fwrite( node->memory, sizeof( byte ), config.mem_size, file );
+
+        // the slots are read directly, a lookup would touch a sparse entry
+        memset( present, config.directory != DIR_SPARSE, dir_lines );
+        memset( dir_states, U, dir_lines );
+        memset( dir_stamps, 0, dir_lines * sizeof( uint32_t ) );
+        memset( dir_sharers, 0, (size_t) dir_lines * words * sizeof( uint64_t ) );
+        int dir_entries = config.directory == DIR_SPARSE ? config.dir_entries : dir_lines;
+        for ( int slot = 0; slot < dir_entries; slot++ ) {
+            int block = config.directory == DIR_SPARSE ? node->dir_tags[ slot ] : slot;
+            if ( block < 0 ) {
+                continue;
+            }
+            sharerSet sharers = directorySharers( node, slot );
+            present[ block ] = 1;
+            dir_slots[ block ] = slot;
+            dir_states[ block ] = node->directory[ slot ].state;
+            dir_owners[ block ] = node->dir_owners ? node->dir_owners[ slot ] : -1;
+            dir_transfers[ block ] = node->dir_transfers ? node->dir_transfers[ slot ] : -1;
+            dir_stamps[ block ] = config.directory == DIR_SPARSE ? node->dir_stamps[ slot ] : 0;
+            memcpy( &dir_sharers[ (size_t) block * words ], sharers.words, words * sizeof( uint64_t ) );
+        }
+        fwrite( present, sizeof( byte ), dir_lines, file );
+        fwrite( dir_states, sizeof( byte ), dir_lines, file );
+        if ( config.protocol == PROTOCOL_MOESI ) {
+            fwrite( dir_owners, sizeof( int32_t ), dir_lines, file );
+        }
+        if ( config.mshrs ) {
+            fwrite( dir_transfers, sizeof( int32_t ), dir_lines, file );
+        }
+        if ( config.directory == DIR_SPARSE ) {
+            fwrite( dir_slots, sizeof( uint32_t ), dir_lines, file );
+            fwrite( dir_stamps, sizeof( uint32_t ), dir_lines, file );
+        }
+        fwrite( dir_sharers, sizeof( uint64_t ), (size_t) dir_lines * words, file );
+
+        for ( int line = 0; line < config.cache_size; line++ ) {
+            line_states[ line ] = node->cache_states[ line ];
+        }
+        fwrite( node->cache_tags, sizeof( memAddress ), config.cache_size, file );
+        fwrite( node->cache_values, sizeof( byte ), (size_t) config.cache_size * config.line_size, file );
+        fwrite( line_states, sizeof( byte ), config.cache_size, file );
+        fwrite( node->cache_stamps, sizeof( uint32_t ), config.cache_size, file );
+
+        for ( int entry = 0; entry < config.mshrs; entry++ ) {
+            if ( node->mshrs[ entry ].address != config.invalid_address ) {
+                fwrite( &node->mshrs[ entry ], sizeof( missEntry ), 1, file );
+            }
+        }
+        fwrite( node->held, sizeof( message ), node->held_count, file );
+
+        for ( size_t pos = msg_buf->head; pos < tail; pos++ ) {
+            fwrite( &msg_buf->slots[ pos & ( MSG_BUFFER_SIZE - 1 ) ].msg, sizeof( message ), 1, file );
+        }
+        fwrite( outboxes[ idx ].sends, sizeof( pendingSend ), outboxes[ idx ].count, file );
+    }
+
+    fclose( file );
+    free( present );
+    free( dir_slots );
+    free( dir_states );
+    free( dir_owners );
+    free( dir_transfers );
+    free( dir_stamps );
+    free( dir_sharers );
+    free( line_states );
+    fprintf( stderr, "checkpoint: %s after %lld instructions\n", filename, issued );
+}
+
+static int compareKeys( const void *a, const void *b ) {
+    uint64_t left = *(const uint64_t *) a, right = *(const uint64_t *) b;
+    return ( left > right ) - ( left < right );
+}
+
+// overwrites the freshly initialized nodes with a checkpoint. The cache and
+// directory may differ from the checkpoint's: lines that no longer fit are
+// evicted with the usual messages and a smaller sparse directory recalls what
+// it cannot hold, racing in-flight traffic like any other eviction
+void restoreCheckpoint( const char *filename, const char *input_dir ) {
+    FILE *file = fopen( filename, "rb" );
+    checkpointHeader header;
+    if ( !file || fread( &header, sizeof( header ), 1, file ) != 1 ||
+         memcmp( header.magic, CHECKPOINT_MAGIC, 4 ) != 0 || header.version != CHECKPOINT_VERSION ) {
+        fprintf( stderr, "Error: %s is not a checkpoint\n", filename );
+        exit( EXIT_FAILURE );
+    }
+    if ( header.num_procs != (uint32_t) config.num_procs || header.mem_size != (uint32_t) config.mem_size ||
+         header.binary_traces != binary_traces || strcmp( header.input_dir, input_dir ) != 0 ) {
+        fprintf( stderr, "Error: %s was taken on %s with %u nodes of %u blocks, %s traces\n",
+                 filename, header.input_dir, header.num_procs, header.mem_size,
+                 header.binary_traces ? "binary" : "text" );
+        exit( EXIT_FAILURE );
+    }
+    // MESI state is valid MOESI state, the other way round O entries have nowhere to go
+    if ( header.protocol == PROTOCOL_MOESI && config.protocol != PROTOCOL_MOESI ) {
+        fprintf( stderr, "Error: %s holds MOESI state, restore it with --protocol=moesi\n", filename );
+        exit( EXIT_FAILURE );
+    }
+    if ( header.mshrs != (uint32_t) config.mshrs ) {
+        fprintf( stderr, "Error: %s was taken with --mshrs=%u\n", filename, header.mshrs );
+        exit( EXIT_FAILURE );
+    }
+    if ( header.line_size != (uint32_t) config.line_size ) {
+        fprintf( stderr, "Error: %s was taken with --line-size=%u\n", filename, header.line_size );
+        exit( EXIT_FAILURE );
+    }
+    bool same_cache = header.cache_size == (uint32_t) config.cache_size &&
+                      header.cache_ways == (uint32_t) config.cache_ways &&
+                      header.replacement == (uint32_t) config.replacement;
+    int dir_entries = config.directory == DIR_SPARSE ? config.dir_entries : config.mem_lines;
+    bool same_directory = header.directory == (uint32_t) config.directory &&
+                          header.dir_entries == (uint32_t) dir_entries;
+
+    int words = header.sharer_words;
+    int lines = header.cache_size;
+    int dir_lines = config.mem_lines;
+    size_t values = (size_t) lines * config.line_size;
+    byte *present = allocOrDie( dir_lines, sizeof( byte ) );
+    uint32_t *dir_slots = allocOrDie( dir_lines, sizeof( uint32_t ) );
+    byte *dir_states = allocOrDie( dir_lines, sizeof( byte ) );
+    int32_t *dir_owners = allocOrDie( dir_lines, sizeof( int32_t ) );
+    int32_t *dir_transfers = allocOrDie( dir_lines, sizeof( int32_t ) );
+    uint32_t *dir_stamps = allocOrDie( dir_lines, sizeof( uint32_t ) );
+    uint64_t *dir_sharers = allocOrDie( (size_t) dir_lines * words, sizeof( uint64_t ) );
+    uint64_t *order = allocOrDie( dir_lines > lines ? dir_lines : lines, sizeof( uint64_t ) );
+    memAddress *line_tags = allocOrDie( lines, sizeof( memAddress ) );
+    byte *line_values = allocOrDie( values, sizeof( byte ) );
+    byte *line_states = allocOrDie( lines, sizeof( byte ) );
+    uint32_t *line_stamps = allocOrDie( lines, sizeof( uint32_t ) );
+    bool ok = true;
+    int in_flight = 0;
+
+    for ( int idx = 0; idx < config.num_procs && ok; idx++ ) {
+        processorNode *node = &nodes[ idx ];
+        checkpointNode saved;
+        ok = fread( &saved, sizeof( saved ), 1, file ) == 1 &&
+             fread( node->memory, sizeof( byte ), config.mem_size, file ) == (size_t) config.mem_size &&
+             fread( present, sizeof( byte ), dir_lines, file ) == (size_t) dir_lines &&
+             fread( dir_states, sizeof( byte ), dir_lines, file ) == (size_t) dir_lines &&
+             ( header.protocol != PROTOCOL_MOESI ||
+               fread( dir_owners, sizeof( int32_t ), dir_lines, file ) == (size_t) dir_lines ) &&
+             ( !header.mshrs ||
+               fread( dir_transfers, sizeof( int32_t ), dir_lines, file ) == (size_t) dir_lines ) &&
+             ( header.directory != DIR_SPARSE ||
+               ( fread( dir_slots, sizeof( uint32_t ), dir_lines, file ) == (size_t) dir_lines &&
+                 fread( dir_stamps, sizeof( uint32_t ), dir_lines, file ) == (size_t) dir_lines ) ) &&
+             fread( dir_sharers, sizeof( uint64_t ), (size_t) dir_lines * words, file ) ==
+                 (size_t) dir_lines * words &&
+             fread( line_tags, sizeof( memAddress ), lines, file ) == (size_t) lines &&
+             fread( line_values, sizeof( byte ), values, file ) == values &&
+             fread( line_states, sizeof( byte ), lines, file ) == (size_t) lines &&
+             fread( line_stamps, sizeof( uint32_t ), lines, file ) == (size_t) lines;
+        if ( !ok ) {
+            break;
+        }
+        node->trace.offset = saved.trace_offset;
+        node->trace.decoded = saved.trace_decoded;
+        if ( workload.pattern != WORKLOAD_NONE ) {
+            // the generator state is rebuilt by drawing the same stream again
+            instruction skipped;
+            node->trace.decoded = 0;
+            while ( node->trace.decoded < saved.trace_decoded ) {
+                nextSynthetic( &node->trace, &skipped );
+            }
+        }
+        node->current_instr = saved.current_instr;
+        node->awaiting_response = saved.awaiting_response;
+        node->done = saved.done;
+        node->has_next = saved.has_next;
+        node->next_instr = saved.next_instr;
+        node->request_type = saved.request_type;
+        node->random_state = saved.random_state;
+        node->clock = saved.clock;
+        node->request_cycle = saved.request_cycle;
+        node->events = saved.events;
+        node->last_miss = saved.last_miss;
+        node->miss_stride = saved.miss_stride;
+        if ( node->done ) {
+            active_nodes--;
+        }
+
+        // an identical directory gets every entry back in its slot, otherwise
+        // blocks go back oldest first so a sparse directory evicts the coldest
+        int blocks = 0;
+        for ( int block = 0; block < dir_lines; block++ ) {
+            if ( present[ block ] ) {
+                order[ blocks++ ] = (uint64_t) dir_stamps[ block ] << 32 | block;
+            }
+        }
+        qsort( order, blocks, sizeof( uint64_t ), compareKeys );
+        for ( int pos = 0; pos < blocks; pos++ ) {
+            int block = (uint32_t) order[ pos ];
+            int slot = block;
+            if ( config.directory == DIR_SPARSE && same_directory ) {
+                slot = dir_slots[ block ];
+                node->dir_tags[ slot ] = block;
+                node->dir_stamps[ slot ] = dir_stamps[ block ];
+            } else if ( config.directory == DIR_SPARSE ) {
+                slot = directorySlot( idx, block << config.line_bits, true );
+            }
+            node->directory[ slot ].state = dir_states[ block ];
+            if ( node->dir_owners ) {
+                node->dir_owners[ slot ] = dir_owners[ block ];
+            }
+            if ( node->dir_transfers ) {
+                node->dir_transfers[ slot ] = dir_transfers[ block ];
+            }
+            directoryClear( node, slot );
+            for ( int sharer = 0; sharer < config.num_procs; sharer++ ) {
+                if ( dir_sharers[ (size_t) block * words + sharer / 64 ] >> ( sharer % 64 ) & 1 ) {
+                    directoryAdd( node, slot, sharer );
+                }
+            }
+        }
+        if ( same_directory ) {
+            node->dir_clock = saved.dir_clock;
+        }
+
+        if ( same_cache ) {
+            memcpy( node->cache_tags, line_tags, lines * sizeof( memAddress ) );
+            memcpy( node->cache_values, line_values, values );
+            for ( int line = 0; line < lines; line++ ) {
+                node->cache_states[ line ] = line_states[ line ];
+            }
+            memcpy( node->cache_stamps, line_stamps, lines * sizeof( uint32_t ) );
+            node->access_clock = saved.access_clock;
+        } else {
+            // least recently used first, so the lines kept are the hottest
+            int valid = 0;
+            for ( int line = 0; line < lines; line++ ) {
+                if ( line_states[ line ] != INVALID ) {
+                    uint64_t stamp = header.replacement == REPLACE_LRU ? line_stamps[ line ] : 0;
+                    order[ valid++ ] = stamp << 32 | line;
+                }
+            }
+            qsort( order, valid, sizeof( uint64_t ), compareKeys );
+            for ( int pos = 0; pos < valid; pos++ ) {
+                int line = (uint32_t) order[ pos ];
+                int slot = cacheSlotFor( node, line_tags[ line ] );
+                if ( node->cache_states[ slot ] != INVALID && node->cache_tags[ slot ] != line_tags[ line ] ) {
+                    handleCacheReplacement( idx, cacheLineAt( node, slot ) );
+                }
+                byte data[ MAX_LINE_SIZE ];
+                for ( int block = 0; block < config.line_size; block++ ) {
+                    data[ block ] = line_values[ (size_t) block * lines + line ];
+                }
+                cacheFill( node, slot, line_tags[ line ], data, line_states[ line ] );
+            }
+        }
+
+        ok = saved.mshr_count <= (uint32_t) config.mshrs &&
+             fread( node->mshrs, sizeof( missEntry ), saved.mshr_count, file ) == saved.mshr_count;
+        node->outstanding = saved.mshr_count;
+        for ( uint32_t count = 0; count < saved.held_count && ok; count++ ) {
+            message msg;
+            ok = fread( &msg, sizeof( msg ), 1, file ) == 1 && holdMessage( idx, msg );
+        }
+
+        for ( uint32_t count = 0; count < saved.ring_count && ok; count++ ) {
+            message msg;
+            ok = fread( &msg, sizeof( msg ), 1, file ) == 1 &&
+                 enqueueMessage( &message_buffers[ idx ], msg );
+        }
+        for ( uint32_t count = 0; count < saved.outbox_count && ok; count++ ) {
+            pendingSend send;
+            ok = fread( &send, sizeof( send ), 1, file ) == 1;
+            if ( ok ) {
+                deferMessage( &outboxes[ idx ], send.receiver, send.msg );
+            }
+        }
+        in_flight += saved.ring_count + saved.outbox_count;
+    }
+    if ( !ok ) {
+        fprintf( stderr, "Error: %s is truncated\n", filename );
+        exit( EXIT_FAILURE );
+    }
+    #pragma omp atomic
+    pending_messages += in_flight;
+
+    restored_issued = header.issued;
+    restored_seeded = header.seeded;
+    restored_seed = header.seed;
+    restored_random_state = header.random_state;
+
+    fclose( file );
+    free( present );
+    free( dir_slots );
+    free( dir_states );
+    free( dir_owners );
+    free( dir_transfers );
+    free( dir_stamps );
+    free( dir_sharers );
+    free( order );
+    free( line_tags );
+    free( line_values );
+    free( line_states );
+    free( line_stamps );
+    fprintf( stderr, "restored %s after %lld instructions\n", filename, restored_issued );
+}
+
+void handleCacheReplacement( int sender, cacheLine old_cache_line ) {
+    int target_proc = homeNode( old_cache_line.address );
+    message evict_msg;
+
+    // coherence messages can mark the direct-mapped line they fall back to
+    // even when it was never filled, there is no block to hand back then
+    if ( old_cache_line.address == config.invalid_address ) {
+        return;
+    }
+
+    if ( old_cache_line.state != INVALID ) {
+        COUNT( sender, cache_evictions, 1 );
+    }
+    
+    switch ( old_cache_line.state ) {
+        case MODIFIED:
+        case OWNED:
+            evict_msg = (message) {
+                .type = EVICT_MODIFIED,
+                .sender = sender,
+                .address = old_cache_line.address,
+            };
+            memcpy( evict_msg.data, old_cache_line.data, config.line_size );
+            sendMessage( target_proc, evict_msg );
+            break;
+        case EXCLUSIVE:
+        case SHARED:
+            evict_msg = (message) {
+                .type = EVICT_SHARED,
+                .sender = sender,
+                .address = old_cache_line.address,
+            };
+            sendMessage( target_proc, evict_msg );
+            break;
+        case INVALID:
+            break;
+    }
+}
+
+// the initial memory, directory and cache contents are where the reference
+// core_N_output.txt files start from, they must not change
+void initializeProcessor( int threadId, processorNode *node, char *dirName ) {
+    // allocated by the owning thread, the machine size is only known at runtime
+    node->memory = allocOrDie( config.mem_size, sizeof( byte ) );
+    int dir_entries = config.directory == DIR_SPARSE ? config.dir_entries : config.mem_lines;
+    node->directory = allocOrDie( dir_entries, sizeof( directoryEntry ) );
+    node->sharer_slab = allocOrDie( dir_entries, config.entry_bytes );
+    node->dir_tags = NULL;
+    node->dir_stamps = NULL;
+    node->dir_owners = NULL;
+    node->dir_transfers = NULL;
+    node->dir_clock = 0;
+    if ( config.directory == DIR_SPARSE ) {
+        node->dir_tags = allocOrDie( dir_entries, sizeof( int ) );
+        node->dir_stamps = allocOrDie( dir_entries, sizeof( uint32_t ) );
+    }
+    if ( config.protocol == PROTOCOL_MOESI ) {
+        node->dir_owners = allocOrDie( dir_entries, sizeof( int ) );
+    }
+    if ( config.mshrs ) {
+        node->dir_transfers = allocOrDie( dir_entries, sizeof( int ) );
+    }
+    node->cache_tags = allocOrDie( config.cache_size, sizeof( memAddress ) );
+    node->cache_values = allocOrDie( (size_t) config.cache_size * config.line_size, sizeof( byte ) );
+    node->cache_states = allocOrDie( config.cache_size, sizeof( cacheLineState ) );
+    node->cache_stamps = allocOrDie( config.cache_size, sizeof( uint32_t ) );
+    node->cache_prefetched = NULL;
+    if ( config.prefetch != PREFETCH_NONE ) {
+        node->cache_prefetched = allocOrDie( config.cache_size, sizeof( byte ) );
+    }
+    node->access_clock = 0;
+    node->random_state = 2463534242u + threadId;
+    node->awaiting_response = 0;
+    node->done = false;
+    node->clock = 0;
+    node->events = 0;
+    node->mshrs = NULL;
+    node->outstanding = 0;
+    node->has_next = false;
+    node->last_miss = config.invalid_address;
+    node->miss_stride = 0;
+    node->held = NULL;
+    node->held_count = 0;
+    node->held_capacity = 0;
+    if ( config.mshrs ) {
+        node->mshrs = allocOrDie( config.mshrs, sizeof( missEntry ) );
+        for ( int i = 0; i < config.mshrs; i++ ) {
+            node->mshrs[ i ].address = config.invalid_address;
+        }
+    }
+
+    for ( int i = 0; i < config.mem_size; i++ ) {
+        node->memory[ i ] = 20 * threadId + i;  // some initial value to mem block
+    }
+    for ( int i = 0; i < dir_entries; i++ ) {
+        directoryClear( node, i );              // no cache has this block at start
+        node->directory[ i ].state = U;         // this block is in Unowned state
+        if ( node->dir_transfers ) {
+            node->dir_transfers[ i ] = -1;
+        }
+        if ( node->dir_tags ) {
+            node->dir_tags[ i ] = -1;
+        }
+    }
+
+    for ( int i = 0; i < config.cache_size; i++ ) {
+        node->cache_tags[ i ] = config.invalid_address; // all ones, the node field
+                                                // is wide enough that no node owns it
+        node->cache_values[ i ] = 0;
+        node->cache_states[ i ] = INVALID;      // all cache lines are invalid
+    }
+
+    if ( workload.pattern != WORKLOAD_NONE ) {
+        openWorkload( &node->trace, threadId );
+        printf( "Processor %d initialized\n", threadId );
+        return;
+    }
+
+    // map core_<threadId>.txt ( or .trc ), instructions are decoded as the node issues them
+    char filename[ 128 ];
+    snprintf(filename, sizeof(filename), "tests/%s/core_%d.%s", dirName, threadId,
+             binary_traces ? "trc" : "txt");
+    openTrace( &node->trace, filename, binary_traces );
+
+    printf( "Processor %d initialized\n", threadId );
+}
+
+void freeProcessor( processorNode *node ) {
+    free( node->memory );
+    free( node->directory );
+    free( node->sharer_slab );
+    free( node->dir_tags );
+    free( node->dir_stamps );
+    free( node->dir_owners );
+    free( node->dir_transfers );
+    free( node->cache_tags );
+    free( node->cache_values );
+    free( node->cache_states );
+    free( node->cache_stamps );
+    free( node->cache_prefetched );
+    free( node->mshrs );
+    free( node->held );
+    closeTrace( &node->trace );
+}
+
+void openTrace( traceReader *trace, const char *filename, bool binary ) {
+    snprintf( trace->filename, sizeof( trace->filename ), "%s", filename );
+    trace->data = NULL;
+    trace->size = 0;
+    trace->offset = 0;
+    trace->decoded = 0;
+    trace->records = NULL;
+    trace->record_count = 0;
+
+    for ( int idx = 0; idx < preloaded_count && !binary; idx++ ) {
+        if ( strcmp( preloaded_traces[ idx ].filename, filename ) == 0 ) {
+            trace->records = preloaded_traces[ idx ].records;
+            trace->record_count = preloaded_traces[ idx ].record_count;
+            return;
+        }
+    }
+
+    int fd = open( filename, O_RDONLY );
+    struct stat info;
+    if ( fd < 0 || fstat( fd, &info ) < 0 ) {
+        fprintf( stderr, "Error: count not open file %s\n", filename );
+        exit( EXIT_FAILURE );
+    }
+
+    // an empty trace cannot be mapped, it simply has no instructions
+    if ( info.st_size > 0 ) {
+        void *data = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( data == MAP_FAILED ) {
+            fprintf( stderr, "Error: could not map file %s\n", filename );
+            exit( EXIT_FAILURE );
+        }
+        madvise( data, info.st_size, MADV_SEQUENTIAL );
+        trace->data = data;
+        trace->size = info.st_size;
+    }
+    close( fd );
+
+    if ( binary ) {
+        const traceHeader *header = (const traceHeader *) trace->data;
+        if ( trace->size < sizeof( traceHeader ) ||
+             memcmp( header->magic, TRACE_MAGIC, 4 ) != 0 ||
+             header->version != TRACE_VERSION ||
+             header->record_size != sizeof( traceRecord ) ||
+             header->num_procs != (uint32_t) config.num_procs ||
+             header->mem_size != (uint32_t) config.mem_size ||
+             trace->size < sizeof( traceHeader ) + header->record_count * sizeof( traceRecord ) ) {
+            fprintf( stderr, "Error: %s is not a trace for this machine\n", filename );
+            exit( EXIT_FAILURE );
+        }
+        trace->records = (const traceRecord *) ( trace->data + sizeof( traceHeader ) );
+        trace->record_count = header->record_count;
+    }
+}
+
+bool readTraceHeader( const char *filename, traceHeader *header ) {
+    FILE *file = fopen( filename, "rb" );
+    if ( !file ) {
+        fprintf( stderr, "Error: count not open file %s\n", filename );
+        return false;
+    }
+    bool ok = fread( header, sizeof( traceHeader ), 1, file ) == 1 &&
+              memcmp( header->magic, TRACE_MAGIC, 4 ) == 0 &&
+              header->version == TRACE_VERSION &&
+              header->num_procs >= 1 && header->num_procs <= MAX_PROCS &&
+              header->mem_size >= 1 && header->cache_size >= 1;
+    fclose( file );
+    if ( !ok ) {
+        fprintf( stderr, "Error: %s is not a binary trace\n", filename );
+    }
+    return ok;
+}
+
+// writes core_N.trc next to every core_N.txt of the test directory
+void convertTraces( const char *dir_name ) {
+    for ( int core = 0; core < config.num_procs; core++ ) {
+        char in_name[ 128 ], out_name[ 128 ];
+        snprintf( in_name, sizeof( in_name ), "tests/%s/core_%d.txt", dir_name, core );
+        snprintf( out_name, sizeof( out_name ), "tests/%s/core_%d.trc", dir_name, core );
+
+        traceReader trace;
+        openTrace( &trace, in_name, false );
+        FILE *out = fopen( out_name, "wb" );
+        if ( !out ) {
+            fprintf( stderr, "Error: could not create %s\n", out_name );
+            exit( EXIT_FAILURE );
+        }
+
+        // the record count is patched in once the text has been decoded
+        traceHeader header = {
+            .magic = TRACE_MAGIC,
+            .version = TRACE_VERSION,
+            .record_size = sizeof( traceRecord ),
+            .core_id = core,
+            .num_procs = config.num_procs,
+            .mem_size = config.mem_size,
+            .cache_size = config.cache_size,
+        };
+        fwrite( &header, sizeof( header ), 1, out );
+
+        instruction instr;
+        while ( nextInstruction( &trace, &instr ) ) {
+            traceRecord record = {
+                .op = instr.type,
+                .value = instr.value,
+                .address = instr.address,
+            };
+            fwrite( &record, sizeof( record ), 1, out );
+            header.record_count++;
+        }
+
+        rewind( out );
+        fwrite( &header, sizeof( header ), 1, out );
+        if ( fclose( out ) != 0 ) {
+            fprintf( stderr, "Error: could not write %s\n", out_name );
+            exit( EXIT_FAILURE );
+        }
+        closeTrace( &trace );
+        printf( "%s: %llu instructions\n", out_name, (unsigned long long) header.record_count );
+    }
+}
+
+// times the original fgets/sscanf loop, the streaming text decoder and the
+// mapped binary format over the same randomly generated trace
+void benchmarkTraceLoading( long long length ) {
+    char text_name[] = "/tmp/cache_simulator_XXXXXX";
+    int fd = mkstemp( text_name );
+    if ( fd < 0 ) {
+        fprintf( stderr, "Error: could not create a temporary trace\n" );
+        exit( EXIT_FAILURE );
+    }
+    char binary_name[ sizeof( text_name ) + 4 ];
+    snprintf( binary_name, sizeof( binary_name ), "%s.trc", text_name );
+
+    FILE *text = fdopen( fd, "w" );
+    FILE *binary = fopen( binary_name, "wb" );
+    traceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof( traceRecord ),
+        .num_procs = config.num_procs,
+        .mem_size = config.mem_size,
+        .cache_size = config.cache_size,
+        .record_count = length,
+    };
+    fwrite( &header, sizeof( header ), 1, binary );
+
+    unsigned int seed = 1;
+    for ( long long idx = 0; idx < length; idx++ ) {
+        seed = seed * 1103515245u + 12345u;
+        memAddress address = ( ( ( seed >> 8 ) % config.num_procs ) << config.index_bits ) |
+                             ( ( seed >> 16 ) % config.mem_size );
+        traceRecord record = { .op = ( seed & 1 ) ? 'W' : 'R', .address = address };
+        if ( record.op == 'W' ) {
+            record.value = seed >> 24;
+            fprintf( text, "WR 0x%02X %u\n", address, record.value );
+        } else {
+            fprintf( text, "RD 0x%02X\n", address );
+        }
+        fwrite( &record, sizeof( record ), 1, binary );
+    }
+    fclose( text );
+    fclose( binary );
+
+    unsigned long long checksum = 0;
+    long long start_ns = nowNanos();
+    {
+        FILE *file = fopen( text_name, "r" );
+        instruction *instructions = allocOrDie( length, sizeof( instruction ) );
+        char line[ 32 ];
+        long long count = 0;
+        while ( fgets( line, sizeof( line ), file ) && count < length ) {
+            if ( line[ 0 ] == 'R' ) {
+                sscanf( line, "RD %x", &instructions[ count ].address );
+            } else {
+                sscanf( line, "WR %x %hhu", &instructions[ count ].address,
+                        &instructions[ count ].value );
+            }
+            checksum += instructions[ count ].address;
+            count++;
+        }
+        fclose( file );
+        free( instructions );
+    }
+    long long sscanf_ns = nowNanos() - start_ns;
+
+    traceReader trace;
+    instruction instr;
+    start_ns = nowNanos();
+    openTrace( &trace, text_name, false );
+    while ( nextInstruction( &trace, &instr ) ) {
+        checksum += instr.address;
+    }
+    closeTrace( &trace );
+    long long text_ns = nowNanos() - start_ns;
+
+    start_ns = nowNanos();
+    openTrace( &trace, binary_name, true );
+    while ( nextInstruction( &trace, &instr ) ) {
+        checksum += instr.address;
+    }
+    closeTrace( &trace );
+    long long binary_ns = nowNanos() - start_ns;
+
+    unlink( text_name );
+    unlink( binary_name );
+
+    printf( "%-16s %12s %16s\n", "loader", "time (ms)", "instrs/sec" );
+    printf( "%-16s %12.2f %16.0f\n", "fgets+sscanf", sscanf_ns / 1e6, length / ( sscanf_ns / 1e9 ) );
+    printf( "%-16s %12.2f %16.0f\n", "streamed text", text_ns / 1e6, length / ( text_ns / 1e9 ) );
+    printf( "%-16s %12.2f %16.0f\n", "mapped binary", binary_ns / 1e6, length / ( binary_ns / 1e9 ) );
+    printf( "checksum %llu\n", checksum );
+}
+
+// runs every configuration of the sweep file on every test directory given,
+// or once each when they generate a workload, and prints one table of the
+// results. The simulator's state is global, so each run is a forked child
+// rather than a thread; the text traces are decoded once, here, and the
+// children share the pages. --jobs runs go at a time, each in a scratch
+// directory that links back to tests/, so their outputs do not collide
+int runSweep( const char *sweep_file, int jobs, const char *report_file, int argc, char *argv[] ) {
+    char **lines;
+    int line_count = readSweepFile( sweep_file, &lines );
+    char **dirs = argv + optind;
+    int dir_count = argc - optind;
+    int runs = line_count * ( dir_count > 0 ? dir_count : 1 );
+
+    // the options before the directories apply to every run, apart from the
+    // sweep's own; getopt has already moved the directories to the end
+    static const char *sweep_options[] = { "--sweep", "--jobs", "--report" };
+    char **base = allocOrDie( argc, sizeof( char * ) );
+    int base_count = 0;
+    for ( int idx = 1; idx < optind; idx++ ) {
+        bool own = false;
+        for ( int opt = 0; opt < 3; opt++ ) {
+            size_t len = strlen( sweep_options[ opt ] );
+            if ( strncmp( argv[ idx ], sweep_options[ opt ], len ) == 0 &&
+                 ( argv[ idx ][ len ] == '\0' || argv[ idx ][ len ] == '=' ) ) {
+                own = true;
+                idx += argv[ idx ][ len ] == '\0';     // --jobs 4 takes the next argument
+                break;
+            }
+        }
+        if ( !own ) {
+            base[ base_count++ ] = argv[ idx ];
+        }
+    }
+
+    if ( !binary_traces ) {
+        for ( int idx = 0; idx < dir_count; idx++ ) {
+            preloadTraces( dirs[ idx ] );
+        }
+    }
+
+    sweepResult *results = allocOrDie( runs, sizeof( sweepResult ) );
+    int *statuses = allocOrDie( runs, sizeof( int ) );
+    pid_t *pids = allocOrDie( jobs, sizeof( pid_t ) );
+    int *result_fds = allocOrDie( jobs, sizeof( int ) );
+    int *slot_runs = allocOrDie( jobs, sizeof( int ) );
+    char ( *scratch )[ 64 ] = allocOrDie( jobs, sizeof( *scratch ) );
+    int next_run = 0, running = 0, failed = 0;
+    long long start_ns = nowNanos();
+
+    while ( next_run < runs || running > 0 ) {
+        if ( next_run < runs && running < jobs ) {
+            int slot = 0;
+            while ( pids[ slot ] != 0 ) {
+                slot++;
+            }
+            // runs go configuration by configuration within each directory
+            char *dir = dir_count > 0 ? dirs[ next_run / line_count ] : NULL;
+            pids[ slot ] = startSweepRun( base, base_count, lines[ next_run % line_count ], dir,
+                                          scratch[ slot ], &result_fds[ slot ] );
+            slot_runs[ slot ] = next_run++;
+            running++;
+            continue;
+        }
+
+        int wait_status;
+        pid_t pid = wait( &wait_status );
+        int slot = 0;
+        while ( slot < jobs && pids[ slot ] != pid ) {
+            slot++;
+        }
+        if ( pid < 0 || slot == jobs ) {
+            continue;
+        }
+        int run = slot_runs[ slot ];
+        bool reported = read( result_fds[ slot ], &results[ run ], sizeof( sweepResult ) ) ==
+                        sizeof( sweepResult );
+        // the exit code, a signal as 128 + its number, or -1 for a run that
+        // exited cleanly without reporting
+        statuses[ run ] = WIFSIGNALED( wait_status ) ? 128 + WTERMSIG( wait_status ) :
+                          WEXITSTATUS( wait_status ) != 0 ? WEXITSTATUS( wait_status ) :
+                          reported ? 0 : -1;
+        if ( statuses[ run ] != 0 ) {
+            failed++;
+            snprintf( results[ run ].input, sizeof( results[ run ].input ), "%s",
+                      dir_count > 0 ? dirs[ run / line_count ] : "-" );
+            char error_name[ 96 ], error_line[ 512 ];
+            snprintf( error_name, sizeof( error_name ), "%s/stderr.txt", scratch[ slot ] );
+            FILE *errors = fopen( error_name, "r" );
+            fprintf( stderr, "run %d ( %s %s ) failed\n", run, results[ run ].input, lines[ run % line_count ] );
+            while ( errors && fgets( error_line, sizeof( error_line ), errors ) ) {
+                fprintf( stderr, "    %s", error_line );
+            }
+            if ( errors ) {
+                fclose( errors );
+            }
+        }
+        close( result_fds[ slot ] );
+        nftw( scratch[ slot ], removeScratchFile, 16, FTW_DEPTH | FTW_PHYS );
+        pids[ slot ] = 0;
+        running--;
+    }
+    long long sweep_ns = nowNanos() - start_ns;
+
+    printf( "%-4s %-24s %-9s %10s %12s %9s %10s %10s  %s\n", "run", "input", "status", "wall ms",
+            "instructions", "miss rate", "messages", "cycles", "configuration" );
+    for ( int run = 0; run < runs; run++ ) {
+        sweepResult *result = &results[ run ];
+        char status[ 16 ];
+        snprintf( status, sizeof( status ), statuses[ run ] == 0 ? "ok" :
+                  statuses[ run ] < 0 ? "no result" : "exit %d", statuses[ run ] );
+        char cycles[ 24 ] = "-";
+        if ( result->cycles ) {
+            snprintf( cycles, sizeof( cycles ), "%lld", result->cycles );
+        }
+        long long accesses = result->hits + result->misses;
+        printf( "%-4d %-24s %-9s %10.2f %12lld %8.1f%% %10lld %10s  %s\n", run, result->input, status,
+                result->wall_ns / 1e6, result->instructions,
+                accesses ? 100.0 * result->misses / accesses : 0.0, result->messages, cycles,
+                lines[ run % line_count ] );
+    }
+    printf( "%d runs, %d failed, %d at a time, %.2f s\n", runs, failed, jobs, sweep_ns / 1e9 );
+
+    if ( report_file ) {
+        writeSweepReport( report_file, lines, line_count, results, statuses, runs );
+    }
+
+    for ( int idx = 0; idx < line_count; idx++ ) {
+        free( lines[ idx ] );
+    }
+    for ( int idx = 0; idx < preloaded_count; idx++ ) {
+        free( preloaded_traces[ idx ].records );
+    }
+    free( preloaded_traces );
+    free( lines );
+    free( base );
+    free( results );
+    free( statuses );
+    free( pids );
+    free( result_fds );
+    free( slot_runs );
+    free( scratch );
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// one configuration per line, given as simulator options; # starts a comment
+int readSweepFile( const char *sweep_file, char ***lines ) {
+    FILE *file = fopen( sweep_file, "r" );
+    if ( !file ) {
+        fprintf( stderr, "Error: could not open %s\n", sweep_file );
+        exit( EXIT_FAILURE );
+    }
+
+    int count = 0, capacity = 0;
+    char line[ 1024 ];
+    *lines = NULL;
+    while ( fgets( line, sizeof( line ), file ) ) {
+        char *comment = strchr( line, '#' );
+        if ( comment ) {
+            *comment = '\0';
+        }
+        size_t len = strlen( line );
+        while ( len > 0 && ( line[ len - 1 ] == '\n' || line[ len - 1 ] == '\r' ||
+                             line[ len - 1 ] == ' ' || line[ len - 1 ] == '\t' ) ) {
+            line[ --len ] = '\0';
+        }
+        char *start = line + strspn( line, " \t" );
+        if ( *start == '\0' ) {
+            continue;
+        }
+        if ( count == capacity ) {
+            capacity = capacity ? capacity * 2 : 16;
+            *lines = realloc( *lines, capacity * sizeof( char * ) );
+            if ( !*lines ) {
+                fprintf( stderr, "Error: out of memory\n" );
+                exit( EXIT_FAILURE );
+            }
+        }
+        ( *lines )[ count++ ] = strdup( start );
+    }
+    fclose( file );
+
+    if ( count == 0 ) {
+        fprintf( stderr, "Error: %s lists no configurations\n", sweep_file );
+        exit( EXIT_FAILURE );
+    }
+    return count;
+}
+
+// forks one run: the base options, then the line's, then the directory.
+// Returns the child's pid with the read end of its result pipe in result_fd
+pid_t startSweepRun( char **base, int base_count, char *line, char *dir, char *scratch, int *result_fd ) {
+    char cwd[ 4096 ], tests[ 4200 ], link[ 128 ];
+    const char *tmp = getenv( "TMPDIR" );
+    snprintf( scratch, 64, "%s/cache_sweep_XXXXXX", tmp && strlen( tmp ) < 40 ? tmp : "/tmp" );
+    int pipe_fds[ 2 ];
+    if ( !getcwd( cwd, sizeof( cwd ) ) || !mkdtemp( scratch ) || pipe( pipe_fds ) != 0 ) {
+        fprintf( stderr, "Error: could not set up a sweep run\n" );
+        exit( EXIT_FAILURE );
+    }
+    snprintf( tests, sizeof( tests ), "%s/tests", cwd );
+    snprintf( link, sizeof( link ), "%s/tests", scratch );
+    if ( symlink( tests, link ) != 0 ) {
+        fprintf( stderr, "Error: could not link %s into %s\n", tests, scratch );
+        exit( EXIT_FAILURE );
+    }
+
+    fflush( stdout );
+    fflush( stderr );
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+        fprintf( stderr, "Error: could not fork a sweep run\n" );
+        exit( EXIT_FAILURE );
+    }
+    if ( pid > 0 ) {
+        close( pipe_fds[ 1 ] );
+        *result_fd = pipe_fds[ 0 ];
+        return pid;
+    }
+
+    // the run: its progress lines are dropped and its stderr kept for the
+    // parent to show if it fails
+    close( pipe_fds[ 0 ] );
+    int null_fd = open( "/dev/null", O_WRONLY );
+    int error_fd = chdir( scratch ) == 0 ? open( "stderr.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : -1;
+    if ( null_fd < 0 || error_fd < 0 || dup2( null_fd, STDOUT_FILENO ) < 0 ||
+         dup2( error_fd, STDERR_FILENO ) < 0 ) {
+        _exit( EXIT_FAILURE );
+    }
+    char *args[ MAX_SWEEP_ARGS + 3 ];
+    int count = 0;
+    args[ count++ ] = "cache_simulator";
+    for ( int idx = 0; idx < base_count && count < MAX_SWEEP_ARGS; idx++ ) {
+        args[ count++ ] = base[ idx ];
+    }
+    for ( char *token = strtok( line, " \t" ); token; token = strtok( NULL, " \t" ) ) {
+        if ( count == MAX_SWEEP_ARGS ) {
+            fprintf( stderr, "Error: a sweep run takes at most %d options\n", MAX_SWEEP_ARGS );
+            exit( EXIT_FAILURE );
+        }
+        args[ count++ ] = token;
+    }
+    if ( dir ) {
+        args[ count++ ] = dir;
+    }
+    args[ count ] = NULL;
+
+    sweep_result_fd = pipe_fds[ 1 ];
+    optind = 0;                 // getopt starts over on the run's own arguments
+    exit( runSimulation( count, args ) );
+}
+
+// decodes every core_N.txt of the test directory once for the whole sweep
+void preloadTraces( const char *dir_name ) {
+    for ( int core = 0; ; core++ ) {
+        char filename[ 128 ];
+        snprintf( filename, sizeof( filename ), "tests/%s/core_%d.txt", dir_name, core );
+        if ( access( filename, R_OK ) != 0 ) {
+            return;
+        }
+        // a directory listed twice is already loaded
+        for ( int idx = 0; idx < preloaded_count; idx++ ) {
+            if ( strcmp( preloaded_traces[ idx ].filename, filename ) == 0 ) {
+                return;
+            }
+        }
+
+        traceReader trace;
+        openTrace( &trace, filename, false );
+        preloaded_traces = realloc( preloaded_traces, ( preloaded_count + 1 ) * sizeof( preloadedTrace ) );
+        if ( !preloaded_traces ) {
+            fprintf( stderr, "Error: out of memory\n" );
+            exit( EXIT_FAILURE );
+        }
+        preloadedTrace *loaded = &preloaded_traces[ preloaded_count ];
+        snprintf( loaded->filename, sizeof( loaded->filename ), "%s", filename );
+        loaded->records = NULL;
+        loaded->record_count = 0;
+
+        long long capacity = 0;
+        traceRecord record;
+        while ( nextTextRecord( &trace, &record ) ) {
+            if ( loaded->record_count == capacity ) {
+                capacity = capacity ? capacity * 2 : 1024;
+                loaded->records = realloc( loaded->records, capacity * sizeof( traceRecord ) );
+                if ( !loaded->records ) {
+                    fprintf( stderr, "Error: out of memory\n" );
+                    exit( EXIT_FAILURE );
+                }
+            }
+            loaded->records[ loaded->record_count++ ] = record;
+        }
+        closeTrace( &trace );
+        preloaded_count++;
+    }
+}
+
+void sendSweepResult( const char *input_dir ) {
+    sweepResult result = { .wall_ns = run_ns };
+    snprintf( result.input, sizeof( result.input ), "%s", input_dir );
+    for ( int idx = 0; idx < config.num_procs; idx++ ) {
+        nodeStats *stats = &node_stats[ idx ];
+        result.instructions += stats->reads + stats->writes;
+        result.hits += stats->cache_hits;
+        result.misses += stats->cache_misses;
+        result.upgrades += stats->upgrades;
+        result.invalidations += stats->invalidations_sent;
+        result.writebacks += stats->memory_writebacks;
+        for ( int type = 0; type < NUM_TRANSACTION_TYPES; type++ ) {
+            result.messages += stats->msgs_sent[ type ];
+        }
+        if ( config.topology != TOPOLOGY_NONE && nodes[ idx ].clock > result.cycles ) {
+            result.cycles = nodes[ idx ].clock;
+        }
+    }
+    if ( write( sweep_result_fd, &result, sizeof( result ) ) != sizeof( result ) ) {
+        fprintf( stderr, "Error: could not report a sweep run\n" );
+    }
+    close( sweep_result_fd );
+}
+
+// the sweep's table as JSON, or CSV if the name ends in .csv ( - for stdout )
+void writeSweepReport( const char *filename, char **lines, int line_count,
+                       sweepResult *results, int *statuses, int runs ) {
+    FILE *report = strcmp( filename, "-" ) == 0 ? stdout : fopen( filename, "w" );
+    if ( !report ) {
+        fprintf( stderr, "Error: could not open %s\n", filename );
+        exit( EXIT_FAILURE );
+    }
+    size_t name_len = strlen( filename );
+    bool csv = name_len > 4 && strcmp( filename + name_len - 4, ".csv" ) == 0;
+
+    if ( csv ) {
+        fprintf( report, "run,input,configuration,status,wall_ns,instructions,hits,misses,upgrades,"
+                         "invalidations,writebacks,messages,cycles\n" );
+    } else {
+        fprintf( report, "{\n  \"runs\": [\n" );
+    }
+    for ( int run = 0; run < runs; run++ ) {
+        sweepResult *result = &results[ run ];
+        if ( csv ) {
+            fprintf( report, "%d,", run );
+            writeQuoted( report, result->input, true );
+            fprintf( report, "," );
+            writeQuoted( report, lines[ run % line_count ], true );
+            fprintf( report, ",%d,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n", statuses[ run ],
+                     result->wall_ns, result->instructions, result->hits, result->misses,
+                     result->upgrades, result->invalidations, result->writebacks, result->messages,
+                     result->cycles );
+        } else {
+            fprintf( report, "    { \"run\": %d, \"input\": ", run );
+            writeQuoted( report, result->input, false );
+            fprintf( report, ", \"configuration\": " );
+            writeQuoted( report, lines[ run % line_count ], false );
+            fprintf( report, ", \"status\": %d, \"wall_ns\": %lld, \"instructions\": %lld, "
+                             "\"hits\": %lld, \"misses\": %lld, \"upgrades\": %lld, \"invalidations\": %lld, "
+                             "\"writebacks\": %lld, \"messages\": %lld, \"cycles\": %lld }%s\n",
+                     statuses[ run ], result->wall_ns, result->instructions, result->hits,
+                     result->misses, result->upgrades, result->invalidations, result->writebacks,
+                     result->messages, result->cycles, run + 1 < runs ? "," : "" );
+        }
+    }
+    if ( !csv ) {
+        fprintf( report, "  ]\n}\n" );
+    }
+    if ( report != stdout ) {
+        fclose( report );
+    }
+}
+
+// CSV doubles embedded quotes, JSON escapes them
+void writeQuoted( FILE *out, const char *text, bool csv ) {
+    fputc( '"', out );
+    for ( ; *text; text++ ) {
+        if ( *text == '"' ) {
+            fputs( csv ? "\"\"" : "\\\"", out );
+        } else if ( *text == '\\' && !csv ) {
+            fputs( "\\\\", out );
+        } else {
+            fputc( *text, out );
+        }
+    }
+    fputc( '"', out );
+}
+
+int removeScratchFile( const char *path, const struct stat *info, int flag, struct FTW *walk ) {
+    (void) info;
+    (void) flag;
+    (void) walk;
+    return remove( path );
+}
+
+// the node's next instruction from its trace or workload, checked against the machine
+bool nextInstruction( traceReader *trace, instruction *instr ) {
+    if ( config.max_instr_num > 0 && trace->decoded >= config.max_instr_num ) {
+        return false;
+    }
+    if ( workload.pattern != WORKLOAD_NONE ) {
+        return nextSynthetic( trace, instr );
+    }
+
+    // binary and preloaded records need no decoding, only the bounds check
+    traceRecord record;
+    if ( trace->records ) {
+        if ( trace->decoded >= trace->record_count ) {
+            return false;
+        }
+        record = trace->records[ trace->decoded ];
+    } else if ( !nextTextRecord( trace, &record ) ) {
+        return false;
+    }
+    trace->decoded++;
+
+    if ( homeNode( record.address ) >= config.num_procs || memIndex( record.address ) >= config.mem_size ) {
+        fprintf( stderr, "Error: address 0x%02X in %s is outside the machine\n",
+                 record.address, trace->filename );
+        exit( EXIT_FAILURE );
+    }
+    instr->type = record.op;
+    instr->address = record.address;
+    instr->value = record.value;
+    return true;
+}
+
+// decodes the next RD/WR line, lines that are neither are skipped. Addresses
+// are not checked, so a sweep can decode traces before it knows the machine
+bool nextTextRecord( traceReader *trace, traceRecord *record ) {
+    const char *data = trace->data;
+    size_t end = trace->size;
+
+    while ( trace->offset < end ) {
+        size_t pos = trace->offset;
+        size_t line_end = pos;
+        while ( line_end < end && data[ line_end ] != '\n' ) {
+            line_end++;
+        }
+        trace->offset = line_end + 1;
+
+        if ( line_end - pos < 2 ) {
+            continue;
+        }
+        char op = data[ pos ];
+        if ( !( op == 'R' && data[ pos + 1 ] == 'D' ) && !( op == 'W' && data[ pos + 1 ] == 'R' ) ) {
+            continue;
+        }
+        pos += 2;
+
+        while ( pos < line_end && data[ pos ] == ' ' ) {
+            pos++;
+        }
+        if ( pos + 1 < line_end && data[ pos ] == '0' && ( data[ pos + 1 ] | 0x20 ) == 'x' ) {
+            pos += 2;
+        }
+        memAddress address = 0;
+        for ( ; pos < line_end; pos++ ) {
+            char c = data[ pos ];
+            if ( c >= '0' && c <= '9' ) {
+                address = address * 16 + ( c - '0' );
+            } else if ( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'f' ) {
+                address = address * 16 + ( ( c | 0x20 ) - 'a' + 10 );
+            } else {
+                break;
+            }
+        }
+
+        unsigned int value = 0;
+        if ( op == 'W' ) {
+            while ( pos < line_end && data[ pos ] == ' ' ) {
+                pos++;
+            }
+            for ( ; pos < line_end && data[ pos ] >= '0' && data[ pos ] <= '9'; pos++ ) {
+                value = value * 10 + ( data[ pos ] - '0' );
+            }
+        }
+
+        *record = (traceRecord) { .op = op, .value = (uint8_t) value, .address = address };
+        return true;
+    }
+
+    return false;
+}
+
+void openWorkload( traceReader *trace, int core_id ) {
+    snprintf( trace->filename, sizeof( trace->filename ), "%s workload", workloadPatternStr[ workload.pattern ] );
+    trace->data = NULL;
+    trace->size = 0;
+    trace->offset = 0;
+    trace->decoded = 0;
+    trace->records = NULL;
+    trace->record_count = 0;
+    trace->core_id = core_id;
+    trace->random_state = ( workload.seed * 2654435761u ) ^ ( ( core_id + 1 ) * 0x9E3779B9u );
+    if ( trace->random_state == 0 ) {
+        trace->random_state = 1;
+    }
+    trace->has_pending = false;
+}
+
+memAddress blockAddress( int home, int index ) {
+    return ( (memAddress) home << config.index_bits ) | index;
+}
+
+// the next access of the node's synthetic stream, a pure function of the seed,
+// the node and how many accesses came before so a restore can regenerate it
+bool nextSynthetic( traceReader *trace, instruction *instr ) {
+    if ( trace->decoded >= workload.length ) {
+        return false;
+    }
+    unsigned int *state = &trace->random_state;
+    int core = trace->core_id;
+    long long step = trace->decoded++;
+    bool write = nextRandom( state ) < workload.write_ratio * 4294967296.0;
+    int home = 0, index = 0;
+
+    switch ( workload.pattern ) {
+        case WORKLOAD_NONE:
+        case WORKLOAD_UNIFORM:
+            home = nextRandom( state ) % config.num_procs;
+            index = nextRandom( state ) % config.mem_size;
+            break;
+        case WORKLOAD_HOTSPOT:
+            home = nextRandom( state ) % 100 < HOTSPOT_PERCENT ? 0 : nextRandom( state ) % config.num_procs;
+            index = nextRandom( state ) % config.mem_size;
+            break;
+        case WORKLOAD_PRODUCER_CONSUMER: {
+            // even nodes fill a buffer homed on their odd partner, which reads
+            // it back in the same order
+            int consumer = ( core | 1 ) < config.num_procs ? ( core | 1 ) : core;
+            home = consumer;
+            index = ( step % PC_BUFFER_BLOCKS ) % config.mem_size;
+            write = core % 2 == 0 && write;
+            break;
+        }
+        case WORKLOAD_MIGRATORY:
+            // read-modify-write on a few shared blocks, each one moving from
+            // cache to cache
+            if ( trace->has_pending ) {
+                trace->has_pending = false;
+                instr->type = 'W';
+                instr->address = trace->pending;
+                instr->value = nextRandom( state );
+                return true;
+            }
+            index = nextRandom( state ) % SHARED_SET_BLOCKS;
+            home = index % config.num_procs;
+            index = index % config.mem_size;
+            trace->has_pending = write;
+            trace->pending = blockAddress( home, index );
+            write = false;
+            break;
+        case WORKLOAD_FALSE_SHARING:
+            // blocks that all map to cache set 0, so they keep evicting each other
+            home = nextRandom( state ) % config.num_procs;
+            index = ( nextRandom( state ) % ( ( config.mem_lines + config.cache_sets - 1 ) / config.cache_sets ) ) *
+                    config.cache_sets % config.mem_lines * config.line_size;
+            break;
+        case WORKLOAD_READ_MOSTLY:
+            // spread over homes and cache sets, so only sharing causes misses
+            index = nextRandom( state ) % SHARED_SET_BLOCKS;
+            home = index % config.num_procs;
+            index = index % config.mem_size;
+            break;
+    }
+
+    instr->type = write ? 'W' : 'R';
+    instr->address = blockAddress( home, index );
+    instr->value = write ? nextRandom( state ) : 0;
+    return true;
+}
+
+void closeTrace( traceReader *trace ) {
+    if ( trace->data ) {
+        munmap( (void *) trace->data, trace->size );
+        trace->data = NULL;
+    }
+}
+
+// the format is compared with the reference core_N_output.txt files byte for
+// byte, it must not change
+void printProcessorState(int processorId, processorNode *node) {
+    static const char *cacheStateStr[] = { "MODIFIED", "EXCLUSIVE", "SHARED",
+                                           "INVALID", "OWNED" };
+    static const char *dirStateStr[] = { "EM", "S", "U", "O" };
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "core_%d_output.txt", processorId);
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        printf("Error: Could not open file %s\n", filename);
+        return;
+    }
+
+    fprintf(file, "=======================================\n");
+    fprintf(file, " Processor Node: %d\n", processorId);
+    fprintf(file, "=======================================\n\n");
+
+    // Print memory state
+    fprintf(file, "-------- Memory State --------\n");
+    fprintf(file, "| Index | Address |   Value  |\n");
+    fprintf(file, "|----------------------------|\n");
+    for (int i = 0; i < config.mem_size; i++) {
+        fprintf(file, "|  %3d  |  0x%02X   |  %5d   |\n", i, (processorId << config.index_bits) + i,
+                node->memory[i]);
+    }
+    fprintf(file, "------------------------------\n\n");
+
+    // Print directory state
+    fprintf(file, "------------ Directory State ---------------\n");
+    fprintf(file, "| Index | Address | State |    BitVector   |\n");
+    fprintf(file, "|------------------------------------------|\n");
+    char bitVector[ MAX_PROCS + 1 ];
+    for (int i = 0; i < config.mem_size; i++) {
+        // a sparse directory without an entry for the block holds it unowned
+        int slot = directoryFind( node, i );
+        sharerSet sharers = { { 0 } };
+        if (slot >= 0) {
+            sharers = directorySharers( node, slot );
+        }
+        formatSharers(sharers.words, bitVector);
+        fprintf(file, "|  %3d  |  0x%02X   |  %2s   |   0x%s   |\n",
+                i, (processorId << config.index_bits) + i,
+                dirStateStr[slot >= 0 ? node->directory[slot].state : U], bitVector);
+    }
+    fprintf(file, "--------------------------------------------\n\n");
+    
+    // Print cache state
+    fprintf(file, "------------ Cache State ----------------\n");
+    fprintf(file, "| Index | Address | Value |    State    |\n");
+    fprintf(file, "|---------------------------------------|\n");
+    for (int i = 0; i < config.cache_size; i++) {
+        fprintf(file, "|  %3d  |  0x%02X   |  %3d  |  %8s \t|\n",
+               i, node->cache_tags[i], node->cache_values[i],
+               cacheStateStr[node->cache_states[i]]);
+    }
+    fprintf(file, "----------------------------------------\n\n");
+
+    fclose(file);
+}
@@ -0,0 +1,152 @@
+#!/bin/bash
+
+# Runs the simulator over a matrix of synthetic workloads, node counts and
+# cache sizes and records throughput and protocol counters for each case.
+#
+#   ./benchmark.sh [--quick] [--repeat=N] [--engine=threaded|pool|seed]
+#                  [--workloads=a,b] [--procs=a,b] [--cache-sizes=a,b] [--length=N]
+#                  [--output=FILE] [--baseline=FILE] [--threshold=PCT] [--pin=P] [--no-build]
+#
+# --output writes the results as JSON, or CSV if FILE ends in .csv. --baseline
+# compares against an earlier JSON output and exits with status 1 if any case
+# lost more than --threshold percent of its throughput or sent that much more
+# messages. Each case is run --repeat times and the run with the median wall
+# time is kept. --pin is passed on to the simulator.
+
+set -u
+
+WORKLOADS="uniform,hotspot,producer-consumer,migratory,false-sharing,read-mostly"
+PROCS="4,16,64"
+CACHE_SIZES="4,16"
+LENGTH=20000
+REPEAT=3
+ENGINE=threaded
+OUTPUT=""
+BASELINE=""
+THRESHOLD=10
+PIN=""
+BUILD=1
+
+for arg in "$@"; do
+    case "$arg" in
+        --quick) WORKLOADS="uniform,migratory"; PROCS="4,16"; CACHE_SIZES="4"; LENGTH=5000; REPEAT=1 ;;
+        --repeat=*) REPEAT=${arg#*=} ;;
+        --engine=*) ENGINE=${arg#*=} ;;
+        --workloads=*) WORKLOADS=${arg#*=} ;;
+        --procs=*) PROCS=${arg#*=} ;;
+        --cache-sizes=*) CACHE_SIZES=${arg#*=} ;;
+        --length=*) LENGTH=${arg#*=} ;;
+        --output=*) OUTPUT=${arg#*=} ;;
+        --baseline=*) BASELINE=${arg#*=} ;;
+        --threshold=*) THRESHOLD=${arg#*=} ;;
+        --pin=*) PIN=${arg#*=} ;;
+        --no-build) BUILD=0 ;;
+        *) sed -n '4,14s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+case "$ENGINE" in
+    threaded) ENGINE_ARGS="" ;;
+    pool) ENGINE_ARGS="--workers" ;;
+    seed) ENGINE_ARGS="--seed=1" ;;
+    *) echo "Error: unknown engine $ENGINE" >&2; exit 2 ;;
+esac
+
+if ! command -v jq > /dev/null; then
+    echo "Error: the benchmark needs jq to read the simulator's reports" >&2
+    exit 2
+fi
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+if [ $BUILD -eq 1 ]; then
+    gcc -fopenmp -O2 -o "$ROOT/cache_simulator" "$ROOT/assignment.c" || exit 2
+fi
+
+# the simulator writes its core_N_output.txt files to the working directory
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+RESULTS="$WORKDIR/results.jsonl"
+: > "$RESULTS"
+
+# reduces one report to a flat record of the figures the benchmark tracks
+summarize() {
+    jq -c --arg workload "$1" --arg engine "$ENGINE" --argjson length "$LENGTH" '
+        ( [ .nodes[].sent | to_entries[] ] | group_by( .key )
+          | map( { key: .[0].key, value: ( map( .value ) | add ) } ) | from_entries ) as $sent
+        | ( [ .nodes[] | .reads + .writes ] | add ) as $instructions
+        | ( $sent | to_entries | map( .value ) | add ) as $messages
+        | {
+            workload: $workload, engine: $engine, procs: .config.procs,
+            cache_size: .config.cache_size, length: $length,
+            wall_ms: ( .run.wall_ns / 1e6 ), peak_rss_kb: .run.peak_rss_kb,
+            instructions: $instructions, messages: $messages,
+            instructions_per_sec: ( $instructions / ( .run.wall_ns / 1e9 ) ),
+            messages_per_sec: ( $messages / ( .run.wall_ns / 1e9 ) ),
+            misses: ( [ .nodes[].misses ] | add ), hits: ( [ .nodes[].hits ] | add ),
+            sent: $sent
+          }' "$2"
+}
+
+printf "%-18s %5s %5s %10s %12s %12s %10s\n" "workload" "procs" "cache" "wall ms" "instr/s" "msgs/s" "rss KB"
+for workload in ${WORKLOADS//,/ }; do
+    for procs in ${PROCS//,/ }; do
+        for cache in ${CACHE_SIZES//,/ }; do
+            runs="$WORKDIR/runs.jsonl"
+            : > "$runs"
+            for ((rep = 1; rep <= REPEAT; rep++)); do
+                report="$WORKDIR/report.json"
+                ( cd "$WORKDIR" && timeout 300 "$ROOT/cache_simulator" $ENGINE_ARGS ${PIN:+--pin=$PIN} --workload="$workload" \
+                      --length="$LENGTH" --procs="$procs" --cache-size="$cache" \
+                      --report="$report" > /dev/null 2>&1 )
+                if [ $? -ne 0 ]; then
+                    echo "Error: $workload with $procs nodes and $cache cache lines failed" >&2
+                    exit 2
+                fi
+                summarize "$workload" "$report" >> "$runs"
+            done
+            jq -s -c 'sort_by( .wall_ms ) | .[ length / 2 | floor ]' "$runs" | tee -a "$RESULTS" |
+                jq -r '[ .workload, .procs, .cache_size, .wall_ms, .instructions_per_sec, .messages_per_sec,
+                         .peak_rss_kb ] | @tsv' |
+                while IFS=$'\t' read -r name p c wall ips mps rss; do
+                    printf "%-18s %5d %5d %10.2f %12.0f %12.0f %10d\n" "$name" "$p" "$c" "$wall" "$ips" "$mps" "$rss"
+                done
+        done
+    done
+done
+
+if [ -n "$OUTPUT" ]; then
+    if [[ "$OUTPUT" == *.csv ]]; then
+        jq -s -r '( .[0].sent | keys_unsorted ) as $types
+            | ( [ "workload", "engine", "procs", "cache_size", "length", "wall_ms", "peak_rss_kb",
+                  "instructions", "messages", "instructions_per_sec", "messages_per_sec", "misses", "hits" ]
+                + ( $types | map( "sent_" + . ) ) | @csv ),
+              ( .[] | [ .workload, .engine, .procs, .cache_size, .length, .wall_ms, .peak_rss_kb,
+                        .instructions, .messages, .instructions_per_sec, .messages_per_sec, .misses, .hits ]
+                      + [ .sent[ $types[] ] ] | @csv )' "$RESULTS" > "$OUTPUT"
+    else
+        jq -s '.' "$RESULTS" > "$OUTPUT"
+    fi
+fi
+
+if [ -n "$BASELINE" ]; then
+    echo ""
+    printf "%-18s %5s %5s %14s %14s\n" "workload" "procs" "cache" "instr/s delta" "msgs delta"
+    regressions=$(jq -s -r --slurpfile baseline "$BASELINE" --argjson threshold "$THRESHOLD" '
+        .[] as $run
+        | ( $baseline[0][] | select( .workload == $run.workload and .engine == $run.engine and
+                                     .procs == $run.procs and .cache_size == $run.cache_size and
+                                     .length == $run.length ) ) as $base
+        | ( ( $run.instructions_per_sec / $base.instructions_per_sec - 1 ) * 100 ) as $speed
+        | ( ( $run.messages / $base.messages - 1 ) * 100 ) as $traffic
+        | [ $run.workload, $run.procs, $run.cache_size, $speed, $traffic,
+            ( if $speed < -$threshold or $traffic > $threshold then "REGRESSION" else "" end ) ] | @tsv' \
+        "$RESULTS" | while IFS=$'\t' read -r name p c speed traffic flag; do
+            printf "%-18s %5d %5d %13.1f%% %13.1f%% %s\n" "$name" "$p" "$c" "$speed" "$traffic" "$flag" >&2
+            [ -n "$flag" ] && echo x
+        done | wc -l)
+    if [ "$regressions" -gt 0 ]; then
+        echo "$regressions case(s) regressed by more than $THRESHOLD%"
+        exit 1
+    fi
+    echo "no regressions beyond $THRESHOLD%"
+fi
@@ -12,15 +12,16 @@ print_centered() {
     printf "=%-*s%s%*s=\n" $padding "" "$text" $padding ""
 }
 
-# Function to run a single test
+# Function to run a single test, any further arguments are passed to the simulator
 run_test() {
     local test_name=$1
     local max_runs=$2
+    shift 2
     local attempt=0
     
     echo ""
     echo "$DIVIDER"
-    print_centered "RUNNING TEST $test_name"
+    print_centered "RUNNING TEST $test_name${*:+ $*}"
     echo "$DIVIDER"
     echo ""
 
@@ -28,14 +29,12 @@ run_test() {
         attempt=$((attempt + 1))
         echo "=== Attempt #$attempt for $test_name $(printf '=%.0s' $(seq 1 $((TERMINAL_WIDTH - 20 - ${#test_name} - ${#attempt}))))"
 
-        # Run simulator in background
-        ./cache_simulator "$test_name" &
-        proc_pid=$!
-        sleep 1
-
-        # Kill the process and its children
-        kill -9 $proc_pid 2>/dev/null
-        pkill -P $proc_pid 2>/dev/null
+        # Run simulator, it exits on its own once every node is quiescent
+        timeout 10 ./cache_simulator "$@" "$test_name" > /dev/null
+        if [ $? -ne 0 ]; then
+            echo "    ✗ simulator did not terminate cleanly"
+            continue
+        fi
 
         # Check against reference runs
         for ((i=1; i<=$max_runs; i++)); do
@@ -73,6 +72,175 @@ run_test() {
     done
 }
 
+# Function to replay every recorded interleaving of a test once, these must
+# reproduce their reference exactly
+replay_test() {
+    local test_name=$1
+    local max_runs=$2
+
+    for ((i=1; i<=$max_runs; i++)); do
+        if [[ "$test_name" == "test_1" || "$test_name" == "test_2" ]]; then
+            ref_dir="tests/$test_name"
+        else
+            ref_dir="tests/$test_name/run_$i"
+        fi
+
+        timeout 10 ./cache_simulator --replay="$ref_dir/instruction_order.txt" "$test_name" > /dev/null
+        if [ $? -ne 0 ]; then
+            echo "  ✗ replay of $ref_dir did not terminate cleanly"
+            return 1
+        fi
+        for core in {0..3}; do
+            diff "core_${core}_output.txt" "$ref_dir/core_${core}_output.txt" > /dev/null
+            if [ $? -ne 0 ]; then
+                echo "  ✗ replay of $ref_dir: core_${core} differs"
+                return 1
+            fi
+        done
+        echo "  ✓ replay of $ref_dir matches"
+    done
+}
+
+# Function to convert a copy of a test to binary traces, drop the text ones and
+# replay every recorded interleaving from the .trc files, which must reproduce
+# the references exactly
+binary_test() {
+    local test_name=$1
+    local max_runs=$2
+    local work_dir=$(mktemp -d tests/convert.XXXXXX)
+    local work_name=$(basename "$work_dir")
+
+    cp tests/$test_name/core_{0..3}.txt "$work_dir"
+    timeout 10 ./cache_simulator --convert "$work_name" > /dev/null &&
+        rm "$work_dir"/core_{0..3}.txt
+    if [ $? -ne 0 ]; then
+        echo "  ✗ converting $test_name failed"
+        rm -rf "$work_dir"
+        return 1
+    fi
+
+    for ((i=1; i<=$max_runs; i++)); do
+        if [[ "$test_name" == "test_1" || "$test_name" == "test_2" ]]; then
+            ref_dir="tests/$test_name"
+        else
+            ref_dir="tests/$test_name/run_$i"
+        fi
+
+        timeout 10 ./cache_simulator --binary --replay="$ref_dir/instruction_order.txt" "$work_name" > /dev/null
+        if [ $? -ne 0 ]; then
+            echo "  ✗ binary replay of $ref_dir did not terminate cleanly"
+            rm -rf "$work_dir"
+            return 1
+        fi
+        for core in {0..3}; do
+            diff "core_${core}_output.txt" "$ref_dir/core_${core}_output.txt" > /dev/null
+            if [ $? -ne 0 ]; then
+                echo "  ✗ binary replay of $ref_dir: core_${core} differs"
+                rm -rf "$work_dir"
+                return 1
+            fi
+        done
+        echo "  ✓ binary replay of $ref_dir matches"
+    done
+    rm -rf "$work_dir"
+}
+
+# Function to run one configuration on the deterministic engine, it must
+# reproduce the reference recorded for it in tests/<test>/<name> exactly
+seeded_test() {
+    local test_name=$1
+    local ref_name=$2
+    shift 2
+    local ref_dir="tests/$test_name/$ref_name"
+
+    timeout 10 ./cache_simulator "$@" "$test_name" > /dev/null
+    if [ $? -ne 0 ]; then
+        echo "  ✗ $ref_dir ( $* ) did not terminate cleanly"
+        return 1
+    fi
+    for core in {0..3}; do
+        diff "core_${core}_output.txt" "$ref_dir/core_${core}_output.txt" > /dev/null
+        if [ $? -ne 0 ]; then
+            echo "  ✗ $ref_dir ( $* ): core_${core} differs"
+            return 1
+        fi
+    done
+    echo "  ✓ $ref_dir ( $* ) matches"
+}
+
+# Function to run a generated workload, which takes no test directory, and
+# compare it with the outputs recorded in tests/workloads/<name>
+workload_test() {
+    local ref_dir="tests/workloads/$1"
+    shift
+
+    timeout 10 ./cache_simulator "$@" > /dev/null
+    if [ $? -ne 0 ]; then
+        echo "  ✗ $ref_dir ( $* ) did not terminate cleanly"
+        return 1
+    fi
+    for core in {0..3}; do
+        diff "core_${core}_output.txt" "$ref_dir/core_${core}_output.txt" > /dev/null
+        if [ $? -ne 0 ]; then
+            echo "  ✗ $ref_dir ( $* ): core_${core} differs"
+            return 1
+        fi
+    done
+    echo "  ✓ $ref_dir ( $* ) matches"
+}
+
+# Function to sweep tests/sweep/sweep.txt over the given tests, every run's
+# counters must match tests/sweep/report.csv. Wall time is left out
+sweep_test() {
+    local work_dir=$(mktemp -d)
+
+    timeout 30 ./cache_simulator --sweep=tests/sweep/sweep.txt --jobs=2 --report="$work_dir/report.csv" \
+        "$@" > /dev/null
+    if [ $? -ne 0 ]; then
+        echo "  ✗ sweep over $* did not run cleanly"
+        rm -rf "$work_dir"
+        return 1
+    fi
+    cut -d, -f5 --complement "$work_dir/report.csv" | diff - tests/sweep/report.csv > /dev/null
+    if [ $? -ne 0 ]; then
+        echo "  ✗ sweep over $*: report differs from tests/sweep/report.csv"
+        rm -rf "$work_dir"
+        return 1
+    fi
+    rm -rf "$work_dir"
+    echo "  ✓ sweep over $* matches tests/sweep/report.csv"
+}
+
+# Function to checkpoint a deterministic run part way and restore it, the
+# restored run must end exactly like the uninterrupted one
+checkpoint_test() {
+    local test_name=$1
+    local at=$2
+    shift 2
+    local work_dir=$(mktemp -d)
+
+    timeout 10 ./cache_simulator "$@" "$test_name" > /dev/null &&
+        cp core_{0..3}_output.txt "$work_dir" &&
+        timeout 10 ./cache_simulator "$@" --checkpoint="$work_dir/checkpoint.bin" --checkpoint-at=$at \
+            "$test_name" > /dev/null 2>&1 &&
+        timeout 10 ./cache_simulator "$@" --restore="$work_dir/checkpoint.bin" "$test_name" > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        echo "  ✗ checkpoint of $test_name ( $* ) after $at instructions did not run cleanly"
+        rm -rf "$work_dir"
+        return 1
+    fi
+    for core in {0..3}; do
+        diff "core_${core}_output.txt" "$work_dir/core_${core}_output.txt" > /dev/null
+        if [ $? -ne 0 ]; then
+            echo "  ✗ restore of $test_name ( $* ) after $at instructions: core_${core} differs"
+            rm -rf "$work_dir"
+            return 1
+        fi
+    done
+    rm -rf "$work_dir"
+    echo "  ✓ restore of $test_name ( $* ) after $at instructions matches"
+}
+
 # Main execution
 echo ""
 echo "$DIVIDER"
@@ -92,6 +260,89 @@ run_test "test_3" 2
 # Run test_4 (4 references)
 run_test "test_4" 4
 
+# The worker pool must end like the threaded engine. test_1 and test_2 have one
+# outcome whatever the order, and a single worker always runs test_4 the way
+# its second reference did
+run_test "test_1" 1 --workers=2
+run_test "test_2" 1 --workers=2
+run_test "test_4" 4 --workers=1
+
+echo ""
+echo "$DIVIDER"
+print_centered "REPLAYING RECORDED ORDERS"
+echo "$DIVIDER"
+echo ""
+
+replay_test "test_1" 1 || exit 1
+replay_test "test_2" 1 || exit 1
+replay_test "test_3" 2 || exit 1
+replay_test "test_4" 4 || exit 1
+
+# --convert and then --binary must decode to the same instructions
+binary_test "test_1" 1 || exit 1
+binary_test "test_2" 1 || exit 1
+binary_test "test_3" 2 || exit 1
+binary_test "test_4" 4 || exit 1
+
+echo ""
+echo "$DIVIDER"
+print_centered "RUNNING SEEDED CONFIGURATIONS"
+echo "$DIVIDER"
+echo ""
+
+# seed 249 has an old owner's write back cross a new writer, where the
+# blocking cache must keep the reference behaviour
+seeded_test "test_4" "seed_249" --seed=249 || exit 1
+seeded_test "test_4" "seed_249_mshrs" --seed=249 --mshrs=4 || exit 1
+seeded_test "test_4" "run_1_mshrs" --replay=tests/test_4/run_1/instruction_order.txt --mshrs=4 || exit 1
+
+# test_4 fits every cache whole, test_1 evicts under each replacement policy
+seeded_test "test_1" "seed_1_assoc_2" --seed=1 --assoc=2 || exit 1
+seeded_test "test_1" "seed_1_plru" --seed=1 --assoc=4 --replacement=plru || exit 1
+seeded_test "test_1" "seed_1_random" --seed=1 --assoc=2 --replacement=random || exit 1
+
+# sample ends with a dirty block OWNED by the node that wrote it, test_3
+# with reads of blocks the home already marked OWNED forwarded to the owner
+seeded_test "sample" "seed_1_moesi" --seed=1 --protocol=moesi || exit 1
+seeded_test "test_3" "seed_1_moesi" --seed=1 --protocol=moesi || exit 1
+seeded_test "test_3" "seed_1_moesi_mshrs" --seed=1 --protocol=moesi --mshrs=4 || exit 1
+
+# lines has cores write neighbouring blocks of shared lines and stream through
+# a home, so at these seeds stale UPGRADEs become writes, moesi writers take
+# the line from its owner and prefetches get used
+seeded_test "lines" "seed_10_line_2" --seed=10 --line-size=2 || exit 1
+seeded_test "lines" "seed_10_line_2_moesi" --seed=10 --line-size=2 --protocol=moesi || exit 1
+seeded_test "lines" "seed_8_next" --seed=8 --line-size=2 --mshrs=4 --prefetch=next || exit 1
+seeded_test "lines" "seed_15_stride" --seed=15 --line-size=2 --mshrs=4 --prefetch=stride || exit 1
+
+# at seed 5 a writer's INV reaches a node that still holds the block MODIFIED,
+# the full map drops that copy rather than writing it home
+seeded_test "lines" "seed_5" --seed=5 || exit 1
+
+# with a pointer per node or an entry per block the other encodings never
+# overflow or recall, so they must end exactly like the full map
+seeded_test "lines" "seed_5" --seed=5 --directory=limited --dir-pointers=4 || exit 1
+seeded_test "lines" "seed_5" --seed=5 --directory=coarse --dir-pointers=4 || exit 1
+seeded_test "lines" "seed_5" --seed=5 --directory=sparse --dir-entries=16 || exit 1
+seeded_test "test_3" "seed_1_moesi" --seed=1 --protocol=moesi --directory=limited --dir-pointers=4 || exit 1
+seeded_test "test_3" "seed_1_moesi" --seed=1 --protocol=moesi --directory=sparse --dir-entries=16 || exit 1
+
+# a single worker drains each node's messages in batches in a fixed order.
+# migratory coalesces INVs and uniform EVICT_SHAREDs, and dropping them must
+# not change outputs recorded with coalescing turned off
+workload_test "migratory_pool" --workers=1 --workload=migratory --length=500 || exit 1
+workload_test "uniform_pool" --workers=1 --workload=uniform --mem-size=4 --length=2000 || exit 1
+
+# each sweep run is a forked child in its own scratch directory, its counters
+# must come out as if the configuration had been run on its own
+sweep_test "test_3" "test_4" || exit 1
+
+# test_3's outputs depend on the order, so a restore that lost the seeded
+# generator's state or any node's would end differently
+checkpoint_test "test_3" 12 --seed=3 || exit 1
+checkpoint_test "test_3" 12 --seed=3 --mshrs=4 || exit 1
+checkpoint_test "test_3" 12 --replay=tests/test_3/run_1/instruction_order.txt || exit 1
+
 echo ""
 echo "$DIVIDER"
 print_centered "ALL TESTS COMPLETED SUCCESSFULLY"